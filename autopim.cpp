@@ -1,49 +1,222 @@
 #include "llvm/IR/Function.h"
-#include "llvm/Pass.h"
-#include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 
-#include "llvm/Transforms/Utils.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/DemandedBits.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Support/KnownBits.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/FormatVariadic.h"
+
+#include "runtime.h"
+#include "pimmodel.h"
 
 #include <sstream>
 #include <vector>
 #include <set>
 #include <map>
+#include <tuple>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "autopim"
+
 namespace {
+    static cl::opt<bool> BatchDispatch("autopim-batch", cl::init(true),
+        cl::desc("Dispatch a sub-loop for the whole outer loop range with a single batched PIM command"));
+
+    static cl::opt<bool> AsyncDispatch("autopim-async", cl::init(true),
+        cl::desc("Launch PIM kernels without blocking and wait for them at the first conflicting host access"));
+
+    static cl::opt<bool> PackLayout("autopim-layout", cl::init(true),
+        cl::desc("Pack read-only arrays column-major or bit-transposed so kernels stream full rows"));
+
+    static cl::opt<double> MinSpeedup("autopim-min-speedup", cl::init(1.0),
+        cl::desc("Only offload a loop when its predicted speedup over the host exceeds this"));
+
+    static cl::opt<unsigned int> RowBytes("autopim-row-bytes", cl::init(PIM_ROW_BYTES),
+        cl::desc("Width of the tiles sub-loops are strip-mined into, in bytes of the widest operand"));
+
+    static cl::opt<unsigned int> Banks("autopim-banks", cl::init(PIM_BANKS),
+        cl::desc("Number of banks the tiles of a sub-loop are distributed across"));
+
+    static cl::opt<bool> RuntimeChecks("autopim-runtime-checks", cl::init(true),
+        cl::desc("Offload loops over arrays that may overlap behind a runtime check, keeping the host loop for when they do"));
+
+    static cl::opt<bool> RowAlignCheck("autopim-row-align-check", cl::init(false),
+        cl::desc("Also require every array of a guarded kernel to start on a DRAM row at runtime"));
+
+    static cl::opt<bool> HostFallback("autopim-host-fallback", cl::init(true),
+        cl::desc("Run independent loops that stay off the PIM unit in parallel on the host, marked for vectorization"));
+
+    static cl::opt<std::string> TargetFile("autopim-target", cl::init(""),
+        cl::desc("JSON description of the PIM target: geometry, per-op latency, energy and area, dispatch overhead"));
+
+    static cl::opt<bool> Autotune("autopim-autotune", cl::init(false),
+        cl::desc("Search tile size, bank count, array layouts and fusion of every kernel against the PIM model"));
+
+    static cl::opt<std::string> TuneCache("autopim-tune-cache", cl::init(""),
+        cl::desc("File the tuned configuration of every kernel is reused from, and written to when autotuning"));
+
+    static cl::opt<bool> RewriteAST("autopim-rewrite", cl::init(true),
+        cl::desc("Rewrite extracted computations into the cheapest equivalent PIM operations before costing them"));
+
+    static cl::opt<bool> Instrument("autopim-instrument", cl::init(false),
+        cl::desc("Insert profiling counters around the loop nests instead of offloading them"));
+
+    static cl::opt<std::string> ProfileFile("autopim-profile", cl::init(""),
+        cl::desc("Profile written by an instrumented build, loop nests that are cold in it stay on the host"));
+
+    static cl::opt<double> MinHotness("autopim-min-hotness", cl::init(0.01),
+        cl::desc("Smallest share of the profiled time a loop nest needs to be offloaded"));
+
+    static cl::opt<unsigned int> AreaBudget("autopim-area-budget", cl::init(0),
+        cl::desc("Area all kernels of the module may take together, in the units of the area model (0 for no limit)"));
+
+    //how a loop nest maps onto the PIM unit: the innermost loop runs across the lanes of a row, the
+    //loop around it is dispatched by the runtime, and any loops further out stay on the host and
+    //dispatch the inner two once per iteration, passing their indices to the kernel as operands
     struct AccessPattern {
-        Value* first_idx;
-        Value* second_idx;
+        Value* first_idx;               //dispatched index, the outer index of the kernel
+        Value* second_idx;              //lane index, the inner index of the kernel
+        std::vector<Value*> host_idx;   //induction variables of the host loops, outermost first
         AccessPattern(Value* v1, Value* v2) : first_idx(v1), second_idx(v2) {}
         AccessPattern() : first_idx(nullptr), second_idx(nullptr) {}
     };
 
+    //an address as an affine function of the induction variables of the loop nest, taken from its
+    //SCEV so it covers every getelementptr index and the arithmetic feeding them: a base that does
+    //not move in the nest plus, per induction variable, a constant stride in bytes per iteration
+    struct AffineAccess {
+        const SCEV* base = nullptr;
+        std::map<Value*, int64_t> strides;
+
+        int64_t getStride(Value* index) const {
+            auto iter = strides.find(index);
+            return iter != strides.end() ? iter->second : 0;
+        }
+    };
+
+    //[start, end) of a loop's induction variable. The bounds are kept as SCEVs so a range that
+    //is only known at runtime can be expanded into the calls, start and end are only valid when
+    //both bounds are constant.
     struct LoopRange {
         unsigned int start;
         unsigned int end;
-        LoopRange() : start(0), end(0) {}
-        LoopRange(int s, int e) : start(s), end(e) {}
+        const SCEV* start_expr;
+        const SCEV* end_expr;
+        bool constant;
+        LoopRange() : start(0), end(0), start_expr(nullptr), end_expr(nullptr), constant(false) {}
+    };
+
+    //an array the kernel reads from a packed shadow copy, converted on function entry
+    struct ArrayLayout {
+        Value* base;                //argument or global the array is based on
+        int layout;                 //pim_layout
+        unsigned int elements;      //elements of the array the kernel touches
+        unsigned int element_bits;
+        unsigned int packed_bits;
+    };
+
+    struct ExtractAST;
+
+    //a store a kernel performs, with the computation of the stored value
+    struct KernelStore {
+        StoreInst* store;
+        ExtractAST* ast;
+        AccessPattern pattern;              //indices of the sub-loop the store is in
+        ExtractAST* mask = nullptr;         //condition of an if around the store, it only writes where it holds
+        bool negated = false;               //the store is on the else side of the if
+    };
+
+    //two accesses alias analysis could not keep apart, the kernel is only dispatched when the
+    //bytes they reach over the loop nest do not overlap at runtime
+    struct AliasCheck {
+        Instruction* first;
+        Instruction* second;
+    };
+
+    //how a kernel is mapped onto the PIM unit, as picked by the autotuner
+    struct TuneConfig {
+        unsigned int tile_elements = 0;
+        unsigned int banks = 0;
+        bool pack = true;                   //arrays are packed into PIM layouts, see chooseLayout
+        bool fuse = true;                   //fused with the next sub-loop, for the kernel of a fusion
+        double speedup = 0;                 //predicted, at the range of the kernel or its break-even trip
+    };
+
+    //counters of a loop nest or an innermost loop in the profile of an instrumented build
+    struct LoopProfile {
+        unsigned long long entries = 0;
+        unsigned long long iterations = 0;
+        double nanoseconds = 0;
+    };
+
+    //a kernel the area budget can be spent on, loops with the same computation share its hardware
+    struct KernelCandidate {
+        unsigned int cost = 0;              //area, the most any of its loops needs
+        unsigned int loops = 0;
+        double host_cycles = 0;             //of its loops, summed
+        double saved_cycles = 0;
+        bool selected = false;
     };
 
     struct CompiledSubLoop {
         unsigned int sub_loop_index;
-        std::string compiled_expr;
+        unsigned int kernel_num = 0;
+        Function* kernel = nullptr;         //sub_loop_fn<N>, computes one element of the sub-loop
+        GlobalVariable* program = nullptr;  //sub_loop_prog<N>, the matching PIM micro-op program
+        unsigned int program_len = 0;
+        std::vector<Value*> operands;       //loop invariant values passed to the kernel at runtime
+        std::vector<KernelStore> stores;    //the stores the kernel performs, in program order
+        std::vector<Loop*> loops;           //the sub-loops the kernel replaces, more than one when fused
+        unsigned int forwarded = 0;         //loads served from an earlier store of the kernel
+        bool fused = false;                 //merged into the kernel of an earlier sub-loop
+        std::vector<ArrayLayout> layouts;   //arrays that are packed before the kernel runs
+        bool pack = PackLayout;             //whether the kernel may pack arrays at all
         LoopRange range;
+        unsigned int tile_elements = 0;     //the range is strip-mined into tiles of this many elements
+        unsigned int banks = 0;             //dealt round-robin to this many banks
+        unsigned int min_trip = 0;          //runtime ranges shorter than this stay on the host
+        std::vector<AliasCheck> alias_checks;
+        unsigned int rewrite_saving = 0;    //area the rewriter took off the computation
+        std::map<std::string, unsigned int> op_counts;  //micro-ops of the program by name
+        unsigned long long bytes_moved = 0; //predicted DRAM traffic of the PIM side
         bool interchanged = false;
         bool compiled = false;
         unsigned int cost = 0;
+        double speedup = 0;                 //predicted host cycles over PIM cycles
+        double energy = 0;                  //predicted PIM energy relative to the host
+        double pim_cycles = 0;              //behind the prediction
+        double host_cycles = 0;
     };
 
     std::map<unsigned int, CompiledSubLoop> sub_loops;
@@ -51,7 +224,21 @@ namespace {
     enum ASTType {
         AST_TYPE_CONSTANT,
         AST_TYPE_ARRAY,
-        AST_TYPE_OP
+        AST_TYPE_OP,
+        AST_TYPE_REDUCTION, //left is the accumulator element, right what every outer iteration adds to it
+        AST_TYPE_SELECT     //left where the condition holds, right where it does not
+    };
+
+    enum ReductionKind {
+        REDUCTION_NONE,
+        REDUCTION_ADD,
+        REDUCTION_AND,
+        REDUCTION_OR,
+        REDUCTION_XOR,
+        REDUCTION_SMIN,
+        REDUCTION_SMAX,
+        REDUCTION_UMIN,
+        REDUCTION_UMAX
     };
 
     struct ExtractAST {
@@ -59,10 +246,69 @@ namespace {
         ExtractAST* right;
         ASTType ast_type; 
         Value* value;
+        ReductionKind reduction = REDUCTION_NONE;
+        unsigned int bits = 32;     //live bit-width of the value, what the PIM op has to compute
+        ExtractAST* condition = nullptr;    //mask of a select
+        unsigned int extensions = 0;        //how the operands were extended, see getExtension and packExtensions
+        unsigned int opcode = 0;            //instruction an op node performs, and the predicate of a compare
+        unsigned int predicate = 0;
         ExtractAST(ASTType type, Value* value) : ast_type(type), value(value), left(nullptr), right(nullptr) {}
     };
 
-    //area numbers taken from Verilog synthesis
+    //nodes are hash-consed on their type, opcode, compare predicate, the extension chains of the
+    //operands, result type, leaf value, operand nodes and the condition of a select, so an AST
+    //is a DAG in which every subexpression appears once
+    typedef std::tuple<int, unsigned int, unsigned int, unsigned int, Type*, Value*, ExtractAST*, ExtractAST*, ExtractAST*> ASTKey;
+
+    //state used while lowering an AST into a sub_loop_fn<N> kernel
+    struct KernelBuilder {
+        Loop* loop;                         //values defined outside this loop become kernel operands
+        IRBuilder<>* builder;
+        Argument* operands_arg;
+        std::map<Value*, Value*> values;    //original value -> value inside the kernel
+        std::map<ExtractAST*, Value*> nodes;    //shared nodes are only lowered once
+        std::map<ExtractAST*, Value*> forwarded;    //loads of what an earlier store of the kernel wrote
+        std::vector<Value*> operands;
+        std::vector<int> program;
+        const AccessPattern* pattern;
+        unsigned int footprint = 0;         //elements of an array the whole loop nest touches, 0 if unknown
+        bool pack = true;
+        std::vector<ArrayLayout> layouts;
+    };
+
+    //width a PIM op works at. Low result bits of add/sub/mul/logic/shl only depend on the same
+    //low bits of the operands, but compares, right shifts and divides need all operand bits.
+    unsigned int getOperandBits(ExtractAST* ast) {
+        unsigned int bits = ast->bits;
+        if (ast->left != NULL) {
+            bits = std::max(bits, ast->left->bits);
+        }
+        if (ast->right != NULL) {
+            bits = std::max(bits, ast->right->bits);
+        }
+        return bits;
+    }
+
+    unsigned int getPIMOpBits(ExtractAST* ast) {
+        if (ast->ast_type != AST_TYPE_OP) {
+            return ast->bits;
+        }
+
+        switch (ast->opcode) {
+            case Instruction::ICmp:
+            case Instruction::LShr:
+            case Instruction::AShr:
+            case Instruction::SDiv:
+            case Instruction::UDiv:
+                return getOperandBits(ast);
+            default:
+                return ast->bits;
+        }
+    }
+
+    //area numbers taken from Verilog synthesis of 32-bit units, scaled down
+    //for narrower units: linearly for adders/logic/comparators, quadratically
+    //for multipliers and dividers
     struct CostModel {
         unsigned int cost_add = 1187;
         unsigned int cost_sub = 1187;
@@ -75,10 +321,26 @@ namespace {
         unsigned int cost_load = 0;  //none because DRAM hardware does this
         unsigned int cost_cmp = 173;   
         unsigned int cost_constant = 0; //none because it can be hardwired in
+        unsigned int cost_transpose = 32 * (cost_and + cost_or); //corner-turn network, one mux per bit
+        unsigned int cost_select = 2 * cost_and + cost_or;      //and both sides with the mask and its complement, or them
+        std::set<ExtractAST*> costed;   //a shared subexpression is one piece of hardware
+
+        //packed layouts need a transpose unit next to the row buffer, shared by all arrays
+        unsigned int computeLayoutCost(const std::vector<ArrayLayout>& layouts) {
+            return layouts.empty() ? 0 : cost_transpose;
+        }
+
+        unsigned int scaleLinear(unsigned int cost, unsigned int bits) {
+            return (cost * std::min(bits, 32u) + 31) / 32;
+        }
+
+        unsigned int scaleQuadratic(unsigned int cost, unsigned int bits) {
+            bits = std::min(bits, 32u);
+            return (cost * bits * bits + 1023) / 1024;
+        }
 
         unsigned int computeCost(ExtractAST* ast) {
-            if (ast != NULL) {
-                Instruction* instruction = nullptr;
+            if (ast != NULL && costed.insert(ast).second) {
                 unsigned int cost_op0 = 0;
                 unsigned int cost_op1 = 0;
 
@@ -88,10 +350,34 @@ namespace {
 
                     case AST_TYPE_ARRAY:
                         return cost_load;
+
+                    case AST_TYPE_SELECT:
+                        return computeCost(ast->condition) + computeCost(ast->left) + computeCost(ast->right) +
+                               scaleLinear(cost_select, ast->bits);
                
+                    case AST_TYPE_REDUCTION:
+                        cost_op0 = computeCost(ast->left);
+                        cost_op1 = computeCost(ast->right);
+
+                        switch (ast->reduction) {
+                            case REDUCTION_ADD:
+                                return cost_op0 + cost_op1 + scaleLinear(cost_add, ast->bits);
+
+                            case REDUCTION_AND:
+                                return cost_op0 + cost_op1 + scaleLinear(cost_and, ast->bits);
+
+                            case REDUCTION_OR:
+                                return cost_op0 + cost_op1 + scaleLinear(cost_or, ast->bits);
+
+                            case REDUCTION_XOR:
+                                return cost_op0 + cost_op1 + scaleLinear(cost_xor, ast->bits);
+
+                            //compare, then blend the two rows with the resulting mask
+                            default:
+                                return cost_op0 + cost_op1 + scaleLinear(cost_cmp + 2 * cost_and + cost_or, ast->bits);
+                        }
+
                     case AST_TYPE_OP:
-                        instruction = dyn_cast<Instruction>(ast->value);
-                        
                         if (ast->left != NULL) {
                             cost_op0 = computeCost(ast->left);
                         }
@@ -99,28 +385,28 @@ namespace {
                             cost_op1 = computeCost(ast->right);
                         }
 
-                        switch (instruction->getOpcode()) {
+                        switch (ast->opcode) {
                             case Instruction::Add:
-                                return cost_op0 + cost_op1 + cost_add;
+                                return cost_op0 + cost_op1 + scaleLinear(cost_add, ast->bits);
 
                             case Instruction::Sub:
-                                return cost_op0 + cost_op1 + cost_sub;
+                                return cost_op0 + cost_op1 + scaleLinear(cost_sub, ast->bits);
 
                             case Instruction::SDiv:
                             case Instruction::UDiv:
-                                return cost_op0 + cost_op1 + cost_div;
+                                return cost_op0 + cost_op1 + scaleQuadratic(cost_div, getOperandBits(ast));
 
                             case Instruction::Mul:
-                                return cost_op0 + cost_op1 + cost_mul;
+                                return cost_op0 + cost_op1 + scaleQuadratic(cost_mul, ast->bits);
 
                             case Instruction::And:
-                                return cost_op0 + cost_op1 + cost_and;
+                                return cost_op0 + cost_op1 + scaleLinear(cost_and, ast->bits);
 
                             case Instruction::Or:
-                                return cost_op0 + cost_op1 + cost_or;
+                                return cost_op0 + cost_op1 + scaleLinear(cost_or, ast->bits);
 
                             case Instruction::Xor:
-                                return cost_op0 + cost_op1 + cost_xor;
+                                return cost_op0 + cost_op1 + scaleLinear(cost_xor, ast->bits);
 
                             case Instruction::LShr:
                             case Instruction::AShr:
@@ -128,7 +414,7 @@ namespace {
                                 return cost_op0 + cost_op1 + cost_shift;
 
                             case Instruction::ICmp:
-                                return cost_op0 + cost_op1 + cost_cmp;
+                                return cost_op0 + cost_op1 + scaleLinear(cost_cmp, getOperandBits(ast));
 
                             default:
                                 return cost_op0 + cost_op1 + 0;
@@ -141,17 +427,132 @@ namespace {
             }
             return 0;
         }
+
+        //a masked store blends the new value into the old one through its mask
+        unsigned int computeStoreCost(const KernelStore& part) {
+            unsigned int cost = computeCost(part.ast);
+            if (part.mask != nullptr) {
+                cost += computeCost(part.mask) + scaleLinear(cost_select, part.ast->bits);
+            }
+            return cost;
+        }
     };
 
-    class PIMGenerator : public LoopPass {
+    class PIMGenerator : public PassInfoMixin<PIMGenerator> {
         public:
-            static char ID;
-            PIMGenerator() : LoopPass(ID) {}
 
             std::map<int, std::string> compiled_sub_loops;
+
+            std::unique_ptr<DemandedBits> demanded_bits;
+            TargetTransformInfo* tti = nullptr;
+            ScalarEvolution* se = nullptr;
+            DominatorTree* dt = nullptr;
+            AAResults* aa = nullptr;
+            DependenceInfo* di = nullptr;
+            OptimizationRemarkEmitter* ore = nullptr;
+
+            //kernels are numbered across the whole module so sub_loop_fn<N> names stay unique
+            unsigned int kernel_count = 0;
+            unsigned int host_loop_count = 0;
+
+            //pim_pack calls already placed on entry to a function, per array and layout
+            std::map<std::tuple<Function*, Value*, int>, CallInst*> packed_arrays;
+
+            //headers of loops that were replaced by PIM calls, they are straight-line code now
+            std::set<BasicBlock*> erased_headers;
+
+            //AST nodes of the function being processed, all released together when it is done
+            BumpPtrAllocator ast_arena;
+            std::map<ASTKey, ExtractAST*> ast_nodes;
+            std::map<ExtractAST*, ExtractAST*> rewritten_nodes;     //what rewriteAST turned a node into
+
+            //the PIM target kernels are costed and tuned for, and the area of its units
+            pim_target target = PIM_DEFAULT_TARGET;
+            CostModel area_model;
+            bool target_loaded = false;
+            bool custom_target = false;     //read from -autopim-target, so the runtime has to be told
+
+            //mappings of kernels by getTuneKey, see tuneKernel
+            std::map<std::string, TuneConfig> tune_cache;
+            bool tune_cache_dirty = false;
+
+            //counters of -autopim-profile by name, see instrumentLoopNest, with the time of all loop nests
+            //in it, and the measured average trip of the innermost loops of the nest being processed
+            std::map<std::string, LoopProfile> profile;
+            double profile_nanoseconds = 0;
+            std::map<Loop*, unsigned long long> profile_trips;
+            bool profile_loaded = false;        //a profile that cannot be read decides nothing
+            unsigned long long profile_calls = 1;   //calls of the nest being processed, 1 without a profile
+            unsigned int profile_count = 0;     //counters of -autopim-instrument, numbered across the module
+
+            //-autopim-area-budget: while planning, every kernel that would be offloaded is a candidate and
+            //none is kept, then selectKernels spends the budget on them and the loops are transformed
+            bool planning = false;
+            bool budget_selected = false;
+            std::map<std::string, KernelCandidate> kernel_candidates;
+
+            //first address seen for every SCEV, loads of equal addresses share their leaf even when
+            //each has a getelementptr of its own, so an operand row is only read once
+            std::map<const SCEV*, Value*> leaf_addresses;
  
-            Value* getIndexVariable(GetElementPtrInst* gep) {
-                return gep->getOperand(gep->getNumOperands() - 1);
+            //the report of the pass, silent while planning the area budget
+            raw_ostream& report() {
+                return planning ? nulls() : outs();
+            }
+
+            //the induction variable of a loop: a header phi counting up by one, from any start so
+            //the loops of a stencil that skip the border, like for (j = 1; j < n - 1; j++), qualify
+            PHINode* getIndexVariable(const Loop* loop) {
+                if (auto induction_variable = loop->getCanonicalInductionVariable()) {
+                    return induction_variable;
+                }
+                for (auto& phi : loop->getHeader()->phis()) {
+                    auto recurrence = dyn_cast<SCEVAddRecExpr>(se->getSCEV(&phi));
+                    if (phi.getType()->isIntegerTy() && recurrence != nullptr && recurrence->getLoop() == loop &&
+                        recurrence->isAffine() && recurrence->getStepRecurrence(*se)->isOne()) {
+                        return &phi;
+                    }
+                }
+                return nullptr;
+            }
+
+            //peel the add recurrences off the SCEV of an address, innermost loop first. Fails when a
+            //stride is not a compile-time constant or a loop has no canonical induction variable.
+            bool getAffineAccess(Value* address, AffineAccess& access) {
+                auto expr = se->getSCEV(address);
+                while (auto recurrence = dyn_cast<SCEVAddRecExpr>(expr)) {
+                    auto step = dyn_cast<SCEVConstant>(recurrence->getStepRecurrence(*se));
+                    auto induction_variable = getIndexVariable(recurrence->getLoop());
+                    if (!recurrence->isAffine() || step == nullptr || induction_variable == nullptr) {
+                        return false;
+                    }
+                    access.strides[induction_variable] = step->getAPInt().getSExtValue();
+                    expr = recurrence->getStart();
+                }
+                access.base = expr;
+                return true;
+            }
+
+            //an access that only moves with the loops of the nest, lane_idx being the innermost one
+            bool isNestAccess(Value* address, Value* lane_idx, const AccessPattern& pattern, AffineAccess& access) {
+                if (!getAffineAccess(address, access)) {
+                    return false;
+                }
+                for (auto& stride : access.strides) {
+                    if (stride.first != lane_idx && stride.first != pattern.first_idx &&
+                        std::find(pattern.host_idx.begin(), pattern.host_idx.end(), stride.first) == pattern.host_idx.end()) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            //an array operand of the kernel: a row or column of the nest that moves with the
+            //dispatched or the lane index, not a single element fixed by the host loops
+            bool isKernelAccess(Value* address, const AccessPattern& pattern) {
+                AffineAccess access;
+                return isNestAccess(address, pattern.second_idx, pattern, access) &&
+                       (access.getStride(pattern.first_idx) != 0 || access.getStride(pattern.second_idx) != 0);
             }
 
            
@@ -160,9 +561,8 @@ namespace {
                 //appropriately indexed getelementptr, or a constant value. Along the way the instructions can only
                 //be add/sub/mul/div/bitwise
 
-                if (auto constant = dyn_cast<Constant>(value)) {
-                    auto ast = new ExtractAST(AST_TYPE_CONSTANT, value);
-                    return ast;
+                if (isa<Constant>(value)) {
+                    return getAST(ASTKey(AST_TYPE_CONSTANT, 0, 0, 0, value->getType(), value, nullptr, nullptr, nullptr), value);
                 }
                 else if (auto instruction = dyn_cast<Instruction>(value)) {
                     switch (instruction->getOpcode()) {
@@ -178,10 +578,16 @@ namespace {
                         case Instruction::AShr:
                         case Instruction::Shl:
                         case Instruction::ICmp: {
-                            auto ast = new ExtractAST(AST_TYPE_OP, value);
-                            ast->left = extractComputation(instruction->getOperand(0), pattern);
-                            ast->right = extractComputation(instruction->getOperand(1), pattern);
-                            return ast;
+                            auto left = extractComputation(instruction->getOperand(0), pattern);
+                            auto right = extractComputation(instruction->getOperand(1), pattern);
+                            //a single operand that cannot be extracted makes the whole computation invalid
+                            if (left == nullptr || right == nullptr) {
+                                return nullptr;
+                            }
+                            auto icmp = dyn_cast<ICmpInst>(instruction);
+                            unsigned int extensions = packExtensions(getExtension(instruction->getOperand(0)), getExtension(instruction->getOperand(1)));
+                            return getAST(ASTKey(AST_TYPE_OP, instruction->getOpcode(), icmp ? (unsigned int)icmp->getPredicate() : 0u, extensions,
+                                                 value->getType(), nullptr, left, right, nullptr), value);
                         }
 
                         case Instruction::ZExt:
@@ -189,11 +595,22 @@ namespace {
                             return extractComputation(instruction->getOperand(0), pattern);
                         }
 
+                        //both sides are computed for every element and blended through the condition
+                        case Instruction::Select:
+                        case Instruction::PHI: {
+                            Value* condition = nullptr;
+                            Value* true_value = nullptr;
+                            Value* false_value = nullptr;
+                            if (!getSelectOperands(instruction, condition, true_value, false_value)) {
+                                return nullptr;
+                            }
+                            return extractSelect(condition, true_value, false_value, value, pattern);
+                        }
+
                         case Instruction::Load: {
-                            auto gep = dyn_cast<GetElementPtrInst>(instruction->getOperand(0));
-                            if (getIndexVariable(gep) == pattern.first_idx || getIndexVariable(gep) == pattern.second_idx) {
-                                auto ast = new ExtractAST(AST_TYPE_ARRAY, value);
-                                return ast;
+                            auto address = instruction->getOperand(0);
+                            if (isKernelAccess(address, pattern)) {
+                                return getAST(ASTKey(AST_TYPE_ARRAY, 0, 0, 0, value->getType(), getLeafAddress(address), nullptr, nullptr, nullptr), value);
                             }
                         }
                         default:
@@ -203,389 +620,2958 @@ namespace {
                 return nullptr;
             }                    
             
-            void compileAST(ExtractAST* ast) {
-                if (ast != NULL) {
-                    Instruction* instruction = nullptr;
+            //the node for condition ? true_value : false_value, value is what carries its result
+            ExtractAST* extractSelect(Value* condition, Value* true_value, Value* false_value, Value* value, const AccessPattern& pattern) {
+                auto mask = extractComputation(condition, pattern);
+                auto left = extractComputation(true_value, pattern);
+                auto right = extractComputation(false_value, pattern);
+                if (mask == nullptr || left == nullptr || right == nullptr) {
+                    return nullptr;
+                }
+                unsigned int extensions = packExtensions(getExtension(true_value), getExtension(false_value));
+                auto ast = getAST(ASTKey(AST_TYPE_SELECT, 0, 0, extensions, value->getType(), nullptr, left, right, mask), value);
+                ast->bits = std::max(ast->bits, std::max(getLiveBits(true_value), getLiveBits(false_value)));
+                return ast;
+            }
 
-                    switch (ast->ast_type) {
-                        case AST_TYPE_CONSTANT:
-                            outs() << " (CONSTANT)";
-                            break;
+            //a select, or a phi that joins the two sides of an if whose blocks do nothing but compute
+            //values, i.e. the diamond or triangle if-conversion turns into a select on the branch condition
+            bool getSelectOperands(Instruction* instruction, Value*& condition, Value*& true_value, Value*& false_value) {
+                if (auto select = dyn_cast<SelectInst>(instruction)) {
+                    condition = select->getCondition();
+                    true_value = select->getTrueValue();
+                    false_value = select->getFalseValue();
+                    return true;
+                }
 
-                        case AST_TYPE_ARRAY:
-                            outs() << " (LOAD)";
-                            break;
-                   
-                        case AST_TYPE_OP:
-                            instruction = dyn_cast<Instruction>(ast->value);
-                            switch (instruction->getOpcode()) {
-                                case Instruction::Add:
-                                    outs() << " (ADD";
-                                    break;
-                                case Instruction::Sub:
-                                    outs() << " (SUB";
-                                    break;
+                auto phi = dyn_cast<PHINode>(instruction);
+                if (phi == nullptr || phi->getNumIncomingValues() != 2 || dt == nullptr) {
+                    return false;
+                }
+                auto join = phi->getParent();
+                auto node = dt->getNode(join);
+                if (node == nullptr || node->getIDom() == nullptr) {
+                    return false;
+                }
+                auto branch_block = node->getIDom()->getBlock();
+                auto br = dyn_cast<BranchInst>(branch_block->getTerminator());
+                if (br == nullptr || !br->isConditional() || br->getSuccessor(0) == br->getSuccessor(1)) {
+                    return false;
+                }
 
-                                case Instruction::SDiv:
-                                    outs() << " (SDIV";
-                                    break;
+                true_value = nullptr;
+                false_value = nullptr;
+                for (unsigned int i = 0; i < 2; i++) {
+                    auto incoming = phi->getIncomingBlock(i);
+                    //the side of the if the value arrives from, either straight from the branch or through a block of its own
+                    auto side = incoming == branch_block ? join : incoming;
+                    if (side != join && (incoming->getSinglePredecessor() != branch_block || incoming->getSingleSuccessor() != join ||
+                                         !isSpeculatable(incoming))) {
+                        return false;
+                    }
+                    if (br->getSuccessor(0) == side) {
+                        true_value = phi->getIncomingValue(i);
+                    }
+                    else if (br->getSuccessor(1) == side) {
+                        false_value = phi->getIncomingValue(i);
+                    }
+                }
+                condition = br->getCondition();
+                return true_value != nullptr && false_value != nullptr;
+            }
 
-                                case Instruction::UDiv:
-                                    outs() << " (UDIV";
-                                    break;
+            //the side of an if the kernel computes unconditionally may not write anything
+            bool isSpeculatable(BasicBlock* block) {
+                for (auto& instruction : *block) {
+                    if (instruction.mayWriteToMemory() || instruction.mayHaveSideEffects()) {
+                        return false;
+                    }
+                }
+                return true;
+            }
 
-                                case Instruction::Mul:
-                                    outs() << " (MUL";
-                                    break;
+            //the number of low bits of a value that carry information: leading bits known to be
+            //zero or copies of the sign bit are dropped, and so are high bits no user demands
+            unsigned int getLiveBits(Value* value) {
+                auto type = value->getType();
+                if (!type->isIntegerTy()) {
+                    return 32;
+                }
 
-                                case Instruction::And:
-                                    outs() << " (AND";
-                                    break;
+                unsigned int width = type->getIntegerBitWidth();
+                const DataLayout* data_layout = nullptr;
+                if (auto instruction = dyn_cast<Instruction>(value)) {
+                    data_layout = &instruction->getModule()->getDataLayout();
+                }
+                else if (auto constant = dyn_cast<ConstantInt>(value)) {
+                    return std::max(constant->getValue().getMinSignedBits(), 1u);
+                }
+                else {
+                    return width;
+                }
 
-                                case Instruction::Or:
-                                    outs() << " (OR";
-                                    break;
+                KnownBits known = computeKnownBits(value, *data_layout);
+                unsigned int bits = std::min(width - known.countMinLeadingZeros(),
+                                             width - ComputeNumSignBits(value, *data_layout) + 1);
 
-                                case Instruction::Xor:
-                                    outs() << " (XOR";
-                                    break;
+                if (demanded_bits != nullptr) {
+                    bits = std::min(bits, demanded_bits->getDemandedBits(cast<Instruction>(value)).getActiveBits());
+                }
+                return std::max(bits, 1u);
+            }
 
-                                case Instruction::LShr:
-                                    outs() << " (LSHR";
-                                    break;
+            Value* getLeafAddress(Value* address) {
+                return leaf_addresses.emplace(se->getSCEV(address), address).first->second;
+            }
 
-                                case Instruction::AShr:
-                                    outs() << " (ASHR";
-                                    break;
+            //how an operand was extended before extraction looked through it, 0 if it was not. Extraction
+            //looks through a whole chain of extensions, which comes down to the extension the leaf was widened
+            //with first and, when a sign extension is followed by a zero extension, the width the sign bit
+            //was copied up to. A zero extension first makes every later extension a zero extension.
+            unsigned int getExtension(Value* operand) {
+                std::vector<Instruction*> chain;
+                while (isa<ZExtInst>(operand) || isa<SExtInst>(operand)) {
+                    chain.push_back(cast<Instruction>(operand));
+                    operand = chain.back()->getOperand(0);
+                }
+                if (chain.empty() || isa<ZExtInst>(chain.back())) {
+                    return chain.empty() ? 0 : Instruction::ZExt;
+                }
+                for (auto extension = chain.rbegin(); extension != chain.rend(); extension++) {
+                    if (isa<ZExtInst>(*extension)) {
+                        return Instruction::SExt | std::min((*extension)->getOperand(0)->getType()->getIntegerBitWidth(), 0xffu) << 8;
+                    }
+                }
+                return Instruction::SExt;
+            }
 
-                                case Instruction::Shl:  
-                                    outs() << " (SHL";
-                                    break;
+            //the extensions of the left and right operand of a node, 16 bits each
+            unsigned int packExtensions(unsigned int left_extension, unsigned int right_extension) {
+                return left_extension | right_extension << 16;
+            }
 
-                                case Instruction::ICmp:
-                                    outs() << " (CMP";
-                                    break;
+            unsigned int getLeftExtension(ExtractAST* ast) {
+                return ast->extensions & 0xffff;
+            }
 
-                                default:
-                                    outs() << " (UNKNOWN_OP";
-                                    break;
-                            }
+            unsigned int getRightExtension(ExtractAST* ast) {
+                return ast->extensions >> 16;
+            }
 
-                            if (ast->left != NULL) {
-                                compileAST(ast->left);
-                            }
-                            if (ast->right != NULL) {
-                                compileAST(ast->right);
-                            }
-                            outs() << ")";
-                            break;
-                        
-                        default:         
-                            break;
-                    }
-                }
+            //the width a sign extension copies the sign bit up to, 0 if up to the width it extends to
+            unsigned int getSignWidth(unsigned int extension) {
+                return (extension & 0xff) == Instruction::SExt ? extension >> 8 : 0;
             }
 
-                    
-            bool isLoopIterationIndependent(Loop* sub_loop, const AccessPattern& pattern) {
-                //for the purposes of this analysis, the only allowed memory accesses patterns are 
-                //arrays accessed by canonical induction variables
-                //if the loop contains a pointer access of any other kind, it is assumed to be 
-                //dependent on previous runs because proving otherwise is expensive
-                for (auto block_iter = sub_loop->block_begin(); block_iter != sub_loop->block_end(); ++block_iter) {
-                    auto induction_variable = sub_loop->getCanonicalInductionVariable();
-                    if (induction_variable == NULL) {
-                        return false;
-                    }
+            //extend a value of a lowered operand the way getExtension recorded
+            Value* extendValue(Value* value, Type* type, unsigned int extension, IRBuilder<>& builder) {
+                unsigned int sign_width = getSignWidth(extension);
+                if (sign_width > value->getType()->getIntegerBitWidth() && sign_width < type->getIntegerBitWidth()) {
+                    value = builder.CreateSExt(value, builder.getIntNTy(sign_width));
+                    return builder.CreateZExt(value, type);
+                }
+                return builder.CreateIntCast(value, type, (extension & 0xff) == Instruction::SExt && sign_width == 0);
+            }
 
-                    for (auto& instruction : **block_iter) {
-                        //handle arrays
-                        if (auto gep = dyn_cast<GetElementPtrInst>(&instruction)) {
-                            auto index_variable = getIndexVariable(gep);
-                            if (index_variable == induction_variable || index_variable == pattern.first_idx) {
-                                continue;
-                            }
-                            else {
-                                return false;
-                            }
-                        }
-                        //handle pointers
-                        else if (auto store = dyn_cast<StoreInst>(&instruction)) {
-                            auto store_address = store->getOperand(1);
-                            //validity of getelementptr is taken care of by the above condition
-                            if (auto gep = dyn_cast<GetElementPtrInst>(store_address)) {
-                                continue;
-                            }
-                            else {
-                                return false;
-                            }
-                        }
-                    }
+            //the node for key, allocated in the arena the first time it is seen. Every node records
+            //its live bit-width, see getPIMOpBits for the width the op runs at. A node shared by
+            //equivalent instructions is as wide as the widest of them.
+            ExtractAST* getAST(const ASTKey& key, Value* value) {
+                unsigned int bits = getLiveBits(value);
+                auto iter = ast_nodes.find(key);
+                if (iter != ast_nodes.end()) {
+                    iter->second->bits = std::max(iter->second->bits, bits);
+                    return iter->second;
                 }
 
-                return true;
+                auto ast = new (ast_arena) ExtractAST(static_cast<ASTType>(std::get<0>(key)), value);
+                ast->left = std::get<6>(key);
+                ast->right = std::get<7>(key);
+                ast->condition = std::get<8>(key);
+                ast->extensions = std::get<3>(key);
+                if (ast->ast_type == AST_TYPE_OP) {
+                    ast->opcode = std::get<1>(key);
+                    ast->predicate = std::get<2>(key);
+                }
+                ast->bits = bits;
+                ast_nodes[key] = ast;
+                return ast;
             }
 
-            bool subLoopIsVectorLoop(Loop* sub_loop, AccessPattern& pattern, Value** store_value) {
-                auto induction_variable = sub_loop->getCanonicalInductionVariable();
-                if (induction_variable == NULL) {
-                    return false;
+            //the type the operands of an op node are computed at, the result type except for compares
+            Type* getOperandType(ExtractAST* ast) {
+                if (auto icmp = dyn_cast<ICmpInst>(ast->value)) {
+                    return icmp->getOperand(0)->getType();
                 }
-                
-                //try to find a store instruction that stores a vector indexed by the loop induction variable
-                for (auto block_iter = sub_loop->block_begin(); block_iter != sub_loop->block_end(); ++block_iter) {
-                    for (auto& instruction : **block_iter) {
-                        if (auto store = dyn_cast<StoreInst>(&instruction)) {
-                            //first operand to store is value, second is address to store at
-                            //address should be the result of a getelementptr with the loop induction var as the index var
-                            auto stored_value = store->getOperand(0);
-                            auto stored_address = store->getOperand(1);
-                            *store_value = stored_value;
-                            
-                            pattern.second_idx = sub_loop->getCanonicalInductionVariable();
+                return ast->value->getType();
+            }
 
-                            //stored value needs to be a function of out[v], A[i][v], and constants only
-                            //outs() << "Function for stored value has the form: ";
-                            //auto ast = extractComputation(stored_value, pattern);
-                            //compileAST(ast);
-                            //outs() << "\n";
- 
-                            if (auto gep = dyn_cast<GetElementPtrInst>(stored_address)) {
-                                if (getIndexVariable(gep) == induction_variable) {
-                                    //since an appropriate getelementptr was found, check if the loop iteration is independent
-                                    return isLoopIterationIndependent(sub_loop, pattern);
-                                }
-                                else {
-                                    return false;
-                                }
-                            }
-                            else {
-                                return false;
-                            }
-                        }
-                    }
+            //an op node the rewriter builds in place of origin, so it computes the same value. The
+            //extensions say how each operand has to be extended to the type origin works at.
+            ExtractAST* getOpAST(unsigned int opcode, unsigned int predicate, ExtractAST* left, unsigned int left_extension,
+                                 ExtractAST* right, unsigned int right_extension, ExtractAST* origin) {
+                auto ast = getAST(ASTKey(AST_TYPE_OP, opcode, predicate, packExtensions(left_extension, right_extension), origin->value->getType(),
+                                         nullptr, left, right, nullptr), origin->value);
+                ast->bits = std::max(ast->bits, origin->bits);
+                return ast;
+            }
+
+            ExtractAST* getConstantAST(Constant* constant) {
+                return getAST(ASTKey(AST_TYPE_CONSTANT, 0, 0, 0, constant->getType(), constant, nullptr, nullptr, nullptr), constant);
+            }
+
+            //an operand that is an integer constant, as a value of the type the op works at
+            ConstantInt* getConstantOperand(ExtractAST* operand, unsigned int extension, Type* type) {
+                auto constant = operand->ast_type == AST_TYPE_CONSTANT ? dyn_cast<ConstantInt>(operand->value) : nullptr;
+                if (constant == nullptr) {
+                    return nullptr;
+                }
+                unsigned int width = type->getIntegerBitWidth();
+                auto value = constant->getValue();
+                unsigned int sign_width = getSignWidth(extension);
+                if (sign_width > value.getBitWidth() && sign_width < width) {
+                    return ConstantInt::get(type->getContext(), value.sext(sign_width).zext(width));
                 }
+                bool sign = (extension & 0xff) == Instruction::SExt && sign_width == 0;
+                return ConstantInt::get(type->getContext(), sign ? value.sextOrTrunc(width) : value.zextOrTrunc(width));
+            }
 
-                return false;
+            //a node that reduces to one of its operands is replaced by it, unless the operand was
+            //extended and so has a different type than the node
+            ExtractAST* getOperandAST(ExtractAST* ast, ExtractAST* operand, unsigned int extension) {
+                return extension == 0 && operand->value->getType() == ast->value->getType() ? operand : ast;
             }
 
+            //rewrite an AST into the cheapest equivalent form the cost model knows of, see rewriteOp.
+            //Nodes are shared, so a rewrite builds new nodes instead of changing the ones it is given.
+            ExtractAST* rewriteAST(ExtractAST* ast) {
+                if (ast == nullptr || ast->ast_type == AST_TYPE_CONSTANT || ast->ast_type == AST_TYPE_ARRAY) {
+                    return ast;
+                }
+                auto iter = rewritten_nodes.find(ast);
+                if (iter != rewritten_nodes.end()) {
+                    return iter->second;
+                }
 
-           //Loop interchange as defined here is valid when the set of vectors
-           //is being iterated over by the outer loop and the set of element
-           //accesses is being iterated over by the inner loop. For PIM, loop
-           //interchange is not valid for ">" and "<" type dependencies, it
-           //only works for "=" types (i.e. directly accessed by that iteration
-           //and independent of it). This is because inside the subloop it is
-           //effectively being vectorized, so we do not have random access ability.
-           bool isLoopInterchangeValid(Loop* loop, Loop* sub_loop, AccessPattern& pattern) {
-                //if loop iterations are not independent, no point doing interchange
-                if (!isLoopIterationIndependent(sub_loop, pattern)) {
-                    return false;
+                auto left = rewriteAST(ast->left);
+                auto right = rewriteAST(ast->right);
+                auto condition = rewriteAST(ast->condition);
+                auto result = ast;
+                if (left != ast->left || right != ast->right || condition != ast->condition) {
+                    unsigned int kind = ast->ast_type == AST_TYPE_REDUCTION ? (unsigned int)ast->reduction : ast->opcode;
+                    result = getAST(ASTKey(ast->ast_type, kind, ast->predicate, ast->extensions, ast->value->getType(), nullptr,
+                                           left, right, condition), ast->value);
+                    result->reduction = ast->reduction;
+                    result->bits = std::max(result->bits, ast->bits);
                 }
 
-                //If all stores that are being fed by a GEP that is based on the index 
-                //of the outer loop, then do loop interchange
-                bool do_interchange = true;
-                for (auto block_iter = sub_loop->block_begin(); block_iter != sub_loop->block_end(); ++block_iter) {
-                    for (auto& instruction : **block_iter) {
+                if (result->ast_type == AST_TYPE_OP) {
+                    result = rewriteOp(result);
+                }
+                else if (result->ast_type == AST_TYPE_SELECT) {
+                    result = rewriteSelect(result);
+                }
+                rewritten_nodes[ast] = result;
+                return result;
+            }
+
+            //rewrite an op whose operands are rewritten already: constants are folded, constant operands
+            //of commutative ops and compares moved to the right, compares of two rows turned into less-than
+            //forms so a > b and b < a share a node, identities and ops of an operand with itself removed,
+            //a compare under a logical not inverted, and multiplies and divides by constants turned into
+            //shifts, which only remap bits, whenever the cost model prices that lower
+            ExtractAST* rewriteOp(ExtractAST* ast) {
+                auto type = getOperandType(ast);
+                if (!type->isIntegerTy()) {
+                    return ast;
+                }
+
+                auto left = ast->left;
+                auto right = ast->right;
+                unsigned int left_extension = getLeftExtension(ast);
+                unsigned int right_extension = getRightExtension(ast);
+                auto left_constant = getConstantOperand(left, left_extension, type);
+                auto right_constant = getConstantOperand(right, right_extension, type);
+                auto predicate = static_cast<CmpInst::Predicate>(ast->predicate);
+                bool compare = ast->opcode == Instruction::ICmp;
+
+                if (left_constant != nullptr && right_constant != nullptr) {
+                    auto& data_layout = cast<Instruction>(ast->value)->getModule()->getDataLayout();
+                    auto folded = compare ? ConstantFoldCompareInstOperands(predicate, left_constant, right_constant, data_layout)
+                                          : ConstantFoldBinaryOpOperands(ast->opcode, left_constant, right_constant, data_layout);
+                    //divisions by zero and shifts past the width do not fold into a number
+                    return isa_and_nonnull<ConstantInt>(folded) ? getConstantAST(folded) : ast;
+                }
+
+                if (left_constant != nullptr && (compare || Instruction::isCommutative(ast->opcode))) {
+                    return rewriteOp(getOpAST(ast->opcode, compare ? (unsigned int)CmpInst::getSwappedPredicate(predicate) : 0u,
+                                              right, right_extension, left, left_extension, ast));
+                }
+                if (compare && right_constant == nullptr && (ICmpInst::isGT(predicate) || ICmpInst::isGE(predicate))) {
+                    return getOpAST(Instruction::ICmp, CmpInst::getSwappedPredicate(predicate), right, right_extension, left, left_extension, ast);
+                }
+
+                if (left == right && left_extension == right_extension) {
+                    switch (ast->opcode) {
+                        case Instruction::And:
+                        case Instruction::Or:
+                            return getOperandAST(ast, left, left_extension);
+                        case Instruction::Xor:
+                        case Instruction::Sub:
+                            return getConstantAST(ConstantInt::get(ast->value->getType(), 0));
+                        case Instruction::ICmp:
+                            return getConstantAST(ConstantInt::get(ast->value->getType(), CmpInst::isTrueWhenEqual(predicate)));
+                        default:
+                            return ast;
+                    }
+                }
+
+                if (right_constant == nullptr) {
+                    return ast;
+                }
+                auto& constant = right_constant->getValue();
+                switch (ast->opcode) {
+                    case Instruction::Add:
+                    case Instruction::Sub:
+                    case Instruction::Shl:
+                    case Instruction::LShr:
+                    case Instruction::AShr:
+                        return constant.isZero() ? getOperandAST(ast, left, left_extension) : ast;
+
+                    case Instruction::Or:
+                        if (constant.isAllOnes()) {
+                            return getConstantAST(right_constant);
+                        }
+                        return constant.isZero() ? getOperandAST(ast, left, left_extension) : ast;
+
+                    case Instruction::And:
+                        if (constant.isZero()) {
+                            return getConstantAST(right_constant);
+                        }
+                        return constant.isAllOnes() ? getOperandAST(ast, left, left_extension) : ast;
+
+                    case Instruction::Xor:
+                        if (constant.isZero()) {
+                            return getOperandAST(ast, left, left_extension);
+                        }
+                        //not of a compare is the inverse compare
+                        if (constant.isAllOnes() && left_extension == 0 && left->ast_type == AST_TYPE_OP && left->opcode == Instruction::ICmp) {
+                            return getOpAST(Instruction::ICmp, CmpInst::getInversePredicate(static_cast<CmpInst::Predicate>(left->predicate)),
+                                            left->left, getLeftExtension(left), left->right, getRightExtension(left), left);
+                        }
+                        return ast;
+
+                    case Instruction::Mul:
+                        if (constant.isZero()) {
+                            return getConstantAST(right_constant);
+                        }
+                        return constant.isOne() ? getOperandAST(ast, left, left_extension) : decomposeMultiply(ast, left, left_extension, constant);
+
+                    case Instruction::UDiv:
+                        if (constant.isPowerOf2()) {
+                            return constant.isOne() ? getOperandAST(ast, left, left_extension) :
+                                   getOpAST(Instruction::LShr, 0, left, left_extension,
+                                            getConstantAST(ConstantInt::get(type, constant.logBase2())), 0, ast);
+                        }
+                        return ast;
+
+                    case Instruction::SDiv:
+                        return constant.isOne() ? getOperandAST(ast, left, left_extension) : ast;
+
+                    default:
+                        return ast;
+                }
+            }
+
+            //a multiply by a constant as shifts of the other operand that are added or subtracted, one
+            //for every nonzero digit of the constant in non-adjacent form, e.g. 10 * x = (x << 3) + (x << 1)
+            //and 7 * x = (x << 3) - x. The multiply is kept when it is cheaper, i.e. the constant has many digits.
+            ExtractAST* decomposeMultiply(ExtractAST* ast, ExtractAST* operand, unsigned int extension, const APInt& constant) {
+                unsigned int width = constant.getBitWidth();
+                if (width > 64) {
+                    return ast;
+                }
+
+                //bit position of every digit and whether it is -1, digits past the width drop out
+                std::vector<std::pair<unsigned int, bool>> digits;
+                uint64_t remaining = constant.getZExtValue();
+                for (unsigned int position = 0; position < width && remaining != 0; position++, remaining >>= 1) {
+                    if (remaining & 1) {
+                        bool negative = (remaining & 3) == 3;
+                        remaining = negative ? remaining + 1 : remaining - 1;
+                        digits.push_back({position, negative});
+                    }
+                }
+
+                auto type = ast->value->getType();
+                ExtractAST* sum = nullptr;
+                unsigned int sum_extension = 0;
+                for (auto digit = digits.rbegin(); digit != digits.rend(); digit++) {
+                    auto term = operand;
+                    unsigned int term_extension = extension;
+                    if (digit->first > 0) {
+                        term = getOpAST(Instruction::Shl, 0, operand, extension, getConstantAST(ConstantInt::get(type, digit->first)), 0, ast);
+                        term_extension = 0;
+                    }
+
+                    if (sum == nullptr && !digit->second) {
+                        sum = term;
+                        sum_extension = term_extension;
+                        continue;
+                    }
+                    if (sum == nullptr) {
+                        sum = getConstantAST(ConstantInt::get(type, 0));
+                    }
+                    sum = getOpAST(digit->second ? Instruction::Sub : Instruction::Add, 0, sum, sum_extension, term, term_extension, ast);
+                    sum_extension = 0;
+                }
+                if (sum == nullptr || sum_extension != 0) {
+                    return ast;
+                }
+
+                CostModel multiply = area_model;
+                CostModel shift_add = area_model;
+                return shift_add.computeCost(sum) < multiply.computeCost(ast) ? sum : ast;
+            }
+
+            //a select on a constant condition, or between two equal sides, is one of its sides
+            ExtractAST* rewriteSelect(ExtractAST* ast) {
+                unsigned int left_extension = getLeftExtension(ast);
+                unsigned int right_extension = getRightExtension(ast);
+                if (ast->condition->ast_type == AST_TYPE_CONSTANT) {
+                    if (auto constant = dyn_cast<ConstantInt>(ast->condition->value)) {
+                        return constant->isZero() ? getOperandAST(ast, ast->right, right_extension) : getOperandAST(ast, ast->left, left_extension);
+                    }
+                }
+                if (ast->left == ast->right && left_extension == right_extension) {
+                    return getOperandAST(ast, ast->left, left_extension);
+                }
+                return ast;
+            }
+
+            const char* getReductionName(ReductionKind kind) {
+                switch (kind) {
+                    case REDUCTION_ADD:
+                        return "ADD";
+                    case REDUCTION_AND:
+                        return "AND";
+                    case REDUCTION_OR:
+                        return "OR";
+                    case REDUCTION_XOR:
+                        return "XOR";
+                    case REDUCTION_SMIN:
+                        return "SMIN";
+                    case REDUCTION_SMAX:
+                        return "SMAX";
+                    case REDUCTION_UMIN:
+                        return "UMIN";
+                    case REDUCTION_UMAX:
+                        return "UMAX";
+                    default:
+                        return "NONE";
+                }
+            }
+
+            bool readsAddress(ExtractAST* ast, const SCEV* address, ScalarEvolution& SE) {
+                if (ast == NULL) {
+                    return false;
+                }
+                if (ast->ast_type == AST_TYPE_ARRAY) {
+                    return SE.getSCEV(cast<LoadInst>(ast->value)->getPointerOperand()) == address;
+                }
+                return readsAddress(ast->left, address, SE) || readsAddress(ast->right, address, SE) ||
+                       readsAddress(ast->condition, address, SE);
+            }
+
+            //a store is a reduction over the outer loop when every outer iteration combines something
+            //into the same element, i.e. out[j] = out[j] op f(A[i][j], ...) where op is add/and/or/xor
+            //or min/max, and the address of out[j] only moves with the sub-loop. PIM can keep that row
+            //resident and reduce into it instead of reloading out[j] on every outer iteration.
+            ExtractAST* extractReduction(Loop* loop, Loop* sub_loop, StoreInst* store, const AccessPattern& pattern, ScalarEvolution& SE) {
+                if (loop == sub_loop) {
+                    return nullptr;
+                }
+
+                auto address = SE.getSCEV(store->getPointerOperand());
+                auto recurrence = dyn_cast<SCEVAddRecExpr>(address);
+                if (recurrence == nullptr || recurrence->getLoop() != sub_loop ||
+                    !SE.isLoopInvariant(recurrence->getStart(), loop) ||
+                    !SE.isLoopInvariant(recurrence->getStepRecurrence(SE), loop)) {
+                    return nullptr;
+                }
+
+                auto value = store->getValueOperand();
+                ReductionKind kind = REDUCTION_NONE;
+                Value* lhs = nullptr;
+                Value* rhs = nullptr;
+
+                if (auto binop = dyn_cast<BinaryOperator>(value)) {
+                    lhs = binop->getOperand(0);
+                    rhs = binop->getOperand(1);
+                    switch (binop->getOpcode()) {
+                        case Instruction::Add:
+                            kind = REDUCTION_ADD;
+                            break;
+                        case Instruction::And:
+                            kind = REDUCTION_AND;
+                            break;
+                        case Instruction::Or:
+                            kind = REDUCTION_OR;
+                            break;
+                        case Instruction::Xor:
+                            kind = REDUCTION_XOR;
+                            break;
+                        default:
+                            return nullptr;
+                    }
+                }
+                else {
+                    switch (matchSelectPattern(value, lhs, rhs).Flavor) {
+                        case SPF_SMIN:
+                            kind = REDUCTION_SMIN;
+                            break;
+                        case SPF_SMAX:
+                            kind = REDUCTION_SMAX;
+                            break;
+                        case SPF_UMIN:
+                            kind = REDUCTION_UMIN;
+                            break;
+                        case SPF_UMAX:
+                            kind = REDUCTION_UMAX;
+                            break;
+                        default:
+                            return nullptr;
+                    }
+                }
+
+                //one side has to be the element that is being stored to
+                auto isAccumulator = [&](Value* v) {
+                    auto load = dyn_cast<LoadInst>(v);
+                    return load != nullptr && sub_loop->contains(load) && SE.getSCEV(load->getPointerOperand()) == address;
+                };
+                if (isAccumulator(rhs)) {
+                    std::swap(lhs, rhs);
+                }
+                if (!isAccumulator(lhs)) {
+                    return nullptr;
+                }
+
+                auto contribution = extractComputation(rhs, pattern);
+                if (contribution == nullptr || readsAddress(contribution, address, SE)) {
+                    return nullptr;
+                }
+
+                auto accumulator = cast<LoadInst>(lhs);
+                auto ast = getAST(ASTKey(AST_TYPE_REDUCTION, kind, 0, 0, value->getType(), nullptr,
+                                         getAST(ASTKey(AST_TYPE_ARRAY, 0, 0, 0, lhs->getType(), getLeafAddress(accumulator->getPointerOperand()), nullptr, nullptr, nullptr), lhs),
+                                         contribution, nullptr), value);
+                ast->reduction = kind;
+                return ast;
+            }
+
+            //the operand of the reduction that is not the accumulator, as it appears in the IR
+            Value* getReductionContribution(ExtractAST* ast) {
+                auto accumulator = ast->left->value;
+                if (auto binop = dyn_cast<BinaryOperator>(ast->value)) {
+                    return binop->getOperand(0) == accumulator ? binop->getOperand(1) : binop->getOperand(0);
+                }
+                auto select = cast<SelectInst>(ast->value);
+                return select->getTrueValue() == accumulator ? select->getFalseValue() : select->getTrueValue();
+            }
+
+            void printAST(ExtractAST* ast, raw_ostream& os) {
+                if (ast != NULL) {
+                    switch (ast->ast_type) {
+                        case AST_TYPE_CONSTANT:
+                            os << " (CONSTANT:" << ast->bits << ")";
+                            break;
+
+                        case AST_TYPE_ARRAY:
+                            os << " (LOAD:" << ast->bits << ")";
+                            break;
+
+                        case AST_TYPE_REDUCTION:
+                            os << " (REDUCE_" << getReductionName(ast->reduction) << ":" << ast->bits;
+                            printAST(ast->left, os);
+                            printAST(ast->right, os);
+                            os << ")";
+                            break;
+
+                        case AST_TYPE_SELECT:
+                            os << " (SELECT:" << ast->bits;
+                            printAST(ast->condition, os);
+                            printAST(ast->left, os);
+                            printAST(ast->right, os);
+                            os << ")";
+                            break;
+                   
+                        case AST_TYPE_OP:
+                            switch (ast->opcode) {
+                                case Instruction::Add:
+                                    os << " (ADD";
+                                    break;
+                                case Instruction::Sub:
+                                    os << " (SUB";
+                                    break;
+
+                                case Instruction::SDiv:
+                                    os << " (SDIV";
+                                    break;
+
+                                case Instruction::UDiv:
+                                    os << " (UDIV";
+                                    break;
+
+                                case Instruction::Mul:
+                                    os << " (MUL";
+                                    break;
+
+                                case Instruction::And:
+                                    os << " (AND";
+                                    break;
+
+                                case Instruction::Or:
+                                    os << " (OR";
+                                    break;
+
+                                case Instruction::Xor:
+                                    os << " (XOR";
+                                    break;
+
+                                case Instruction::LShr:
+                                    os << " (LSHR";
+                                    break;
+
+                                case Instruction::AShr:
+                                    os << " (ASHR";
+                                    break;
+
+                                case Instruction::Shl:  
+                                    os << " (SHL";
+                                    break;
+
+                                case Instruction::ICmp:
+                                    os << " (CMP";
+                                    break;
+
+                                default:
+                                    os << " (UNKNOWN_OP";
+                                    break;
+                            }
+                            os << ":" << ast->bits;
+
+                            if (ast->left != NULL) {
+                                printAST(ast->left, os);
+                            }
+                            if (ast->right != NULL) {
+                                printAST(ast->right, os);
+                            }
+                            os << ")";
+                            break;
+                        
+                        default:         
+                            break;
+                    }
+                }
+            }
+
+
+            //a masked store shows the condition it writes under
+            void printStore(const KernelStore& part, raw_ostream& os) {
+                if (part.mask == nullptr) {
+                    printAST(part.ast, os);
+                    return;
+                }
+                os << (part.negated ? " (STORE_IF_NOT" : " (STORE_IF");
+                printAST(part.mask, os);
+                printAST(part.ast, os);
+                os << ")";
+            }
+
+            int getPIMOp(unsigned int opcode) {
+                switch (opcode) {
+                    case Instruction::Add:
+                        return PIM_OP_ADD;
+                    case Instruction::Sub:
+                        return PIM_OP_SUB;
+                    case Instruction::Mul:
+                        return PIM_OP_MUL;
+                    case Instruction::SDiv:
+                    case Instruction::UDiv:
+                        return PIM_OP_DIV;
+                    case Instruction::And:
+                        return PIM_OP_AND;
+                    case Instruction::Or:
+                        return PIM_OP_OR;
+                    case Instruction::Xor:
+                        return PIM_OP_XOR;
+                    case Instruction::LShr:
+                    case Instruction::AShr:
+                    case Instruction::Shl:
+                        return PIM_OP_SHIFT;
+                    case Instruction::ICmp:
+                        return PIM_OP_CMP;
+                    default:
+                        return PIM_OP_NOP;
+                }
+            }
+
+            unsigned int getBitWidth(Type* type) {
+                return type->isIntegerTy() ? type->getIntegerBitWidth() : 32;
+            }
+
+            //make a value used by the sub-loop available inside the kernel. Induction variables are
+            //mapped to the kernel arguments up front, values defined outside the loop nest are passed
+            //in through the operands array and address arithmetic in between is cloned.
+            Value* materializeValue(Value* value, KernelBuilder& kb) {
+                auto iter = kb.values.find(value);
+                if (iter != kb.values.end()) {
+                    return iter->second;
+                }
+
+                if (isa<Constant>(value)) {
+                    return value;
+                }
+
+                auto instruction = dyn_cast<Instruction>(value);
+                if (instruction == nullptr || !kb.loop->contains(instruction)) {
+                    Type* type = value->getType();
+                    if (!type->isPointerTy() && !type->isIntegerTy()) {
+                        return nullptr;
+                    }
+
+                    auto i8ptr = kb.builder->getInt8PtrTy();
+                    auto slot = kb.builder->CreateConstInBoundsGEP1_32(i8ptr, kb.operands_arg, kb.operands.size());
+                    Value* operand = kb.builder->CreateLoad(i8ptr, slot);
+                    if (type->isPointerTy()) {
+                        operand = kb.builder->CreateBitCast(operand, type);
+                    }
+                    else {
+                        operand = kb.builder->CreatePtrToInt(operand, type);
+                    }
+
+                    kb.operands.push_back(value);
+                    kb.values[value] = operand;
+                    return operand;
+                }
+
+                if (!isa<GetElementPtrInst>(instruction) && !isa<CastInst>(instruction) && !isa<BinaryOperator>(instruction)) {
+                    return nullptr;
+                }
+
+                auto clone = instruction->clone();
+                for (unsigned int i = 0; i < instruction->getNumOperands(); i++) {
+                    auto operand = materializeValue(instruction->getOperand(i), kb);
+                    if (operand == nullptr) {
+                        clone->deleteValue();
+                        return nullptr;
+                    }
+                    clone->setOperand(i, operand);
+                }
+                kb.builder->Insert(clone);
+                kb.values[value] = clone;
+                return clone;
+            }
+
+            //the runtime functions only touch memory through the PIM unit, except for the host
+            //fallback which runs a loop on the host cores
+            bool isPIMCall(CallBase* call) {
+                auto callee = call->getCalledFunction();
+                return callee != nullptr && callee->getName().startswith("pim_") && callee->getName() != "pim_hostrange";
+            }
+
+            //the packed copy of an array is only a shadow of its C layout, so it stays valid
+            //as long as nothing in the function writes to the array
+            bool isReadOnlyArray(Function* function, Value* base) {
+                for (auto& block : *function) {
+                    for (auto& instruction : block) {
+                        if (auto store = dyn_cast<StoreInst>(&instruction)) {
+                            if (mayShareMemory(store->getPointerOperand(), base)) {
+                                return false;
+                            }
+                        }
+                        else if (auto call = dyn_cast<CallBase>(&instruction)) {
+                            if (call->mayWriteToMemory() && !isPIMCall(call)) {
+                                return false;
+                            }
+                        }
+                        else if (instruction.mayWriteToMemory()) {
+                            return false;
+                        }
+                    }
+                }
+                return true;
+            }
+
+            //pick the layout an array leaf is read in. A leaf whose lanes are not consecutive elements
+            //walks a column, one row activation per element, unless the array is packed column-major
+            //first. A leaf with fewer live bits than its element is packed bit-transposed so only the
+            //live bit planes are read. Only arrays the host loops do not move in are packed, the
+            //shadow covers the elements of one dispatch.
+            int chooseLayout(LoadInst* load, unsigned int live_bits, KernelBuilder& kb) {
+                auto address = load->getPointerOperand();
+                auto& data_layout = load->getModule()->getDataLayout();
+                AffineAccess access;
+                getAffineAccess(address, access);
+                int64_t lane_stride = kb.pattern->first_idx != kb.pattern->second_idx ? access.getStride(kb.pattern->second_idx) : 0;
+                bool strided = lane_stride != 0 && std::abs(lane_stride) != (int64_t)data_layout.getTypeStoreSize(load->getType());
+                int fallback = strided ? PIM_LAYOUT_STRIDED : PIM_LAYOUT_ROW;
+
+                unsigned int element_bits = getBitWidth(load->getType());
+                bool narrow = live_bits < element_bits;
+                bool host_moved = std::any_of(kb.pattern->host_idx.begin(), kb.pattern->host_idx.end(),
+                                              [&](Value* index) { return access.getStride(index) != 0; });
+                if (!kb.pack || kb.footprint == 0 || host_moved || (!strided && !narrow)) {
+                    return fallback;
+                }
+
+                //the shadow is built on function entry, so the array has to exist by then
+                auto base = getUnderlyingObject(address);
+                if ((!isa<Argument>(base) && !isa<GlobalVariable>(base)) || !isReadOnlyArray(load->getFunction(), base)) {
+                    return fallback;
+                }
+
+                ArrayLayout array_layout;
+                array_layout.base = base;
+                array_layout.layout = narrow ? PIM_LAYOUT_VERTICAL : PIM_LAYOUT_COLUMN;
+                array_layout.elements = kb.footprint;
+                array_layout.element_bits = element_bits;
+                array_layout.packed_bits = narrow ? live_bits : element_bits;
+
+                for (auto& other : kb.layouts) {
+                    if (other.base == base && other.layout == array_layout.layout) {
+                        other.packed_bits = std::max(other.packed_bits, array_layout.packed_bits);
+                        return array_layout.layout;
+                    }
+                }
+                kb.layouts.push_back(array_layout);
+                return array_layout.layout;
+            }
+
+            //extensions are looked through during extraction, so operands are converted
+            //back to the type the original instruction expected by replaying its extension chain
+            Value* coerceValue(Value* value, Value* original, KernelBuilder& kb) {
+                return extendValue(value, original->getType(), getExtension(original), *kb.builder);
+            }
+
+            //emit the IR for an AST into the kernel and the matching micro-ops into its program
+            Value* compileAST(ExtractAST* ast, KernelBuilder& kb) {
+                if (ast == NULL) {
+                    return nullptr;
+                }
+
+                auto iter = kb.nodes.find(ast);
+                if (iter != kb.nodes.end()) {
+                    return iter->second;
+                }
+                auto value = compileNode(ast, kb);
+                kb.nodes[ast] = value;
+                return value;
+            }
+
+            //lower a single node, its operands go through compileAST so shared ones are reused
+            Value* compileNode(ExtractAST* ast, KernelBuilder& kb) {
+
+                switch (ast->ast_type) {
+                    case AST_TYPE_CONSTANT:
+                        kb.program.push_back(PIM_INSN(PIM_OP_CONSTANT, getPIMOpBits(ast)));
+                        return ast->value;
+
+                    case AST_TYPE_ARRAY: {
+                        //the element is still in the row buffer, no need to read it back from DRAM
+                        auto forward = kb.forwarded.find(ast);
+                        if (forward != kb.forwarded.end()) {
+                            return forward->second;
+                        }
+
+                        auto load = cast<LoadInst>(ast->value);
+                        auto address = materializeValue(load->getPointerOperand(), kb);
+                        if (address == nullptr) {
+                            return nullptr;
+                        }
+                        //only a bit-transposed array lets the load skip the dead bit planes
+                        int layout = chooseLayout(load, getPIMOpBits(ast), kb);
+                        unsigned int bits = layout == PIM_LAYOUT_VERTICAL ? getPIMOpBits(ast) : getBitWidth(load->getType());
+                        kb.program.push_back(PIM_INSN(PIM_OP_LOAD, bits) | PIM_LAYOUT(layout));
+                        return kb.builder->CreateLoad(load->getType(), address);
+                    }
+
+                    case AST_TYPE_REDUCTION: {
+                        //the accumulator row is loaded once and stays resident on the PIM side
+                        unsigned int accumulator_insn = kb.program.size();
+                        auto accumulator = compileAST(ast->left, kb);
+                        if (accumulator == nullptr) {
+                            return nullptr;
+                        }
+                        kb.program[accumulator_insn] |= PIM_REDUCE;
+
+                        auto contribution = compileAST(ast->right, kb);
+                        if (contribution == nullptr) {
+                            return nullptr;
+                        }
+                        contribution = coerceValue(contribution, getReductionContribution(ast), kb);
+
+                        Value* result = nullptr;
+                        int op = PIM_OP_NOP;
+                        switch (ast->reduction) {
+                            case REDUCTION_ADD:
+                                result = kb.builder->CreateAdd(accumulator, contribution);
+                                op = PIM_OP_ADD;
+                                break;
+                            case REDUCTION_AND:
+                                result = kb.builder->CreateAnd(accumulator, contribution);
+                                op = PIM_OP_AND;
+                                break;
+                            case REDUCTION_OR:
+                                result = kb.builder->CreateOr(accumulator, contribution);
+                                op = PIM_OP_OR;
+                                break;
+                            case REDUCTION_XOR:
+                                result = kb.builder->CreateXor(accumulator, contribution);
+                                op = PIM_OP_XOR;
+                                break;
+                            case REDUCTION_SMIN:
+                                result = kb.builder->CreateSelect(kb.builder->CreateICmpSLT(accumulator, contribution), accumulator, contribution);
+                                op = PIM_OP_MIN;
+                                break;
+                            case REDUCTION_SMAX:
+                                result = kb.builder->CreateSelect(kb.builder->CreateICmpSGT(accumulator, contribution), accumulator, contribution);
+                                op = PIM_OP_MAX;
+                                break;
+                            case REDUCTION_UMIN:
+                                result = kb.builder->CreateSelect(kb.builder->CreateICmpULT(accumulator, contribution), accumulator, contribution);
+                                op = PIM_OP_MIN;
+                                break;
+                            case REDUCTION_UMAX:
+                                result = kb.builder->CreateSelect(kb.builder->CreateICmpUGT(accumulator, contribution), accumulator, contribution);
+                                op = PIM_OP_MAX;
+                                break;
+                            default:
+                                return nullptr;
+                        }
+                        kb.program.push_back(PIM_INSN(op, getPIMOpBits(ast)) | PIM_REDUCE);
+                        return result;
+                    }
+
+                    case AST_TYPE_OP: {
+                        auto left = compileAST(ast->left, kb);
+                        auto right = compileAST(ast->right, kb);
+                        if (left == nullptr || right == nullptr) {
+                            return nullptr;
+                        }
+
+                        //the node may come from the rewriter, so the operands are cast back by how the node
+                        //says they were extended rather than by the instruction it was extracted from
+                        auto type = getOperandType(ast);
+                        left = extendValue(left, type, getLeftExtension(ast), *kb.builder);
+                        right = extendValue(right, type, getRightExtension(ast), *kb.builder);
+                        kb.program.push_back(PIM_INSN(getPIMOp(ast->opcode), getPIMOpBits(ast)));
+
+                        if (ast->opcode == Instruction::ICmp) {
+                            return kb.builder->CreateICmp(static_cast<CmpInst::Predicate>(ast->predicate), left, right);
+                        }
+                        return kb.builder->CreateBinOp(static_cast<Instruction::BinaryOps>(ast->opcode), left, right);
+                    }
+
+                    case AST_TYPE_SELECT: {
+                        auto mask = compileMask(ast->condition, false, kb);
+                        auto left = compileAST(ast->left, kb);
+                        auto right = compileAST(ast->right, kb);
+                        if (mask == nullptr || left == nullptr || right == nullptr) {
+                            return nullptr;
+                        }
+
+                        //the value the node stands for may be a phi, so the sides are cast back from how they were extended
+                        auto type = ast->value->getType();
+                        left = extendValue(left, type, getLeftExtension(ast), *kb.builder);
+                        right = extendValue(right, type, getRightExtension(ast), *kb.builder);
+                        kb.program.push_back(PIM_INSN(PIM_OP_SELECT, getPIMOpBits(ast)));
+                        return kb.builder->CreateSelect(mask, left, right);
+                    }
+
+                    default:
+                        return nullptr;
+                }
+            }
+
+            //lower a condition into the i1 mask a select or masked store blends with
+            Value* compileMask(ExtractAST* ast, bool negated, KernelBuilder& kb) {
+                auto mask = compileAST(ast, kb);
+                if (mask == nullptr) {
+                    return nullptr;
+                }
+                if (!mask->getType()->isIntegerTy(1)) {
+                    mask = kb.builder->CreateIsNotNull(mask);
+                }
+                return negated ? kb.builder->CreateNot(mask) : mask;
+            }
+
+            //lower the computation of a sub-loop into a function of the form
+            //void sub_loop_fn<N>(i64 outer_index, i64 inner_index, i8** operands)
+            //that performs a single iteration of the sub-loop, plus the micro-op
+            //program sub_loop_prog<N> the runtime uses to cost it. A kernel with several
+            //stores reads its operands once and writes every result row. A fused kernel
+            //performs the stores of all its sub-loops one after the other, and reads
+            //an element an earlier sub-loop wrote straight from the value it stored.
+            bool emitKernel(Loop* loop, CompiledSubLoop& csl) {
+                auto module = loop->getHeader()->getModule();
+                auto& context = module->getContext();
+                auto i32 = Type::getInt32Ty(context);
+                auto i64 = Type::getInt64Ty(context);
+                auto operands_type = Type::getInt8PtrTy(context)->getPointerTo();
+                auto ft = FunctionType::get(Type::getVoidTy(context), {i64, i64, operands_type}, false);
+
+                std::stringstream ss;
+                ss << "sub_loop_fn" << csl.kernel_num;
+                auto kernel = Function::Create(ft, GlobalValue::InternalLinkage, ss.str(), module);
+                auto entry = BasicBlock::Create(context, "entry", kernel);
+                IRBuilder<> builder(entry);
+
+                KernelBuilder kb;
+                kb.loop = loop;
+                kb.builder = &builder;
+                kb.operands_arg = kernel->getArg(2);
+                kb.pack = csl.pack;
+                //when the loop is processed as its own sub-loop both indices are the same
+                //value, and the inner index is the one that varies inside the kernel
+                for (auto& part : csl.stores) {
+                    if (part.pattern.first_idx != nullptr) {
+                        kb.values[part.pattern.first_idx] = builder.CreateIntCast(kernel->getArg(0), part.pattern.first_idx->getType(), true);
+                    }
+                    kb.values[part.pattern.second_idx] = builder.CreateIntCast(kernel->getArg(1), part.pattern.second_idx->getType(), true);
+                }
+
+                auto& pattern = csl.stores[0].pattern;
+                LoopRange outer_range;
+                if (csl.range.constant && csl.range.end > csl.range.start) {
+                    if (pattern.first_idx == nullptr || pattern.first_idx == pattern.second_idx) {
+                        kb.footprint = csl.range.end - csl.range.start;
+                    }
+                    else if (getLoopRange(loop, outer_range) && outer_range.constant && outer_range.end > outer_range.start) {
+                        kb.footprint = (csl.range.end - csl.range.start) * (outer_range.end - outer_range.start);
+                    }
+                }
+
+                std::vector<Value*> stored;
+                for (auto& part : csl.stores) {
+                    kb.pattern = &part.pattern;
+                    std::vector<ExtractAST*> leaves;
+                    collectArrays(part.mask, leaves);
+                    collectArrays(part.ast, leaves);
+                    for (auto leaf : leaves) {
+                        //within a sub-loop the element is read before it is stored, see areStoresIndependent
+                        auto load = cast<LoadInst>(leaf->value);
+                        auto address = load->getPointerOperand();
+                        for (int i = stored.size() - 1; i >= 0; i--) {
+                            auto earlier = csl.stores[i].store;
+                            bool same_loop = std::any_of(csl.loops.begin(), csl.loops.end(), [&](Loop* l) {
+                                return l->contains(earlier) && l->contains(load);
+                            });
+                            if (!same_loop && isSameElement(address, earlier->getPointerOperand())) {
+                                kb.forwarded[leaf] = stored[i];
+                                break;
+                            }
+                        }
+                    }
+
+                    auto store = part.store;
+                    auto value = compileAST(part.ast, kb);
+                    auto address = materializeValue(store->getPointerOperand(), kb);
+                    if (value == nullptr || address == nullptr) {
+                        kernel->eraseFromParent();
+                        return false;
+                    }
+
+                    value = coerceValue(value, store->getValueOperand(), kb);
+                    int masked = 0;
+                    if (part.mask != nullptr) {
+                        //elements the condition does not hold for keep what they held
+                        auto mask = compileMask(part.mask, part.negated, kb);
+                        if (mask == nullptr) {
+                            kernel->eraseFromParent();
+                            return false;
+                        }
+                        value = builder.CreateSelect(mask, value, builder.CreateLoad(value->getType(), address));
+                        masked = PIM_MASKED;
+                    }
+                    builder.CreateStore(value, address);
+                    kb.program.push_back(PIM_INSN(PIM_OP_STORE, getBitWidth(value->getType())) | masked |
+                                         (part.ast->ast_type == AST_TYPE_REDUCTION ? PIM_REDUCE : 0));
+                    stored.push_back(value);
+                }
+                builder.CreateRetVoid();
+
+                std::vector<Constant*> insns;
+                for (auto insn : kb.program) {
+                    insns.push_back(ConstantInt::get(i32, insn));
+                }
+                auto program_type = ArrayType::get(i32, insns.size());
+
+                ss.str("");
+                ss << "sub_loop_prog" << csl.kernel_num;
+                csl.program = new GlobalVariable(*module, program_type, true, GlobalValue::PrivateLinkage,
+                                                 ConstantArray::get(program_type, insns), ss.str());
+                csl.program_len = insns.size();
+                csl.kernel = kernel;
+                csl.operands = kb.operands;
+                csl.layouts = kb.layouts;
+                csl.forwarded = kb.forwarded.size();
+                return true;
+            }
+
+            void collectArrays(ExtractAST* ast, std::vector<ExtractAST*>& leaves) {
+                if (ast == NULL) {
+                    return;
+                }
+                if (ast->ast_type == AST_TYPE_ARRAY && std::find(leaves.begin(), leaves.end(), ast) == leaves.end()) {
+                    leaves.push_back(ast);
+                }
+                collectArrays(ast->condition, leaves);
+                collectArrays(ast->left, leaves);
+                collectArrays(ast->right, leaves);
+            }
+
+            //two addresses in sibling sub-loops with the same range refer to the same element on
+            //every iteration when they advance from the same start by the same step
+            bool isSameElement(Value* a, Value* b) {
+                if (a == b) {
+                    return true;
+                }
+                auto recurrence_a = dyn_cast<SCEVAddRecExpr>(se->getSCEV(a));
+                auto recurrence_b = dyn_cast<SCEVAddRecExpr>(se->getSCEV(b));
+                return recurrence_a != nullptr && recurrence_b != nullptr && recurrence_a->isAffine() && recurrence_b->isAffine() &&
+                       recurrence_a->getStart() == recurrence_b->getStart() &&
+                       recurrence_a->getStepRecurrence(*se) == recurrence_b->getStepRecurrence(*se) &&
+                       a->getType() == b->getType();
+            }
+                    
+            bool isLoopIterationIndependent(Loop* sub_loop, const AccessPattern& pattern) {
+                //the kernel walks its operands as rows, so every access has to be an affine function of
+                //the loops of the nest. Whether the accesses depend on each other across iterations is
+                //left to DependenceInfo in areStoresIndependent.
+                for (auto block_iter = sub_loop->block_begin(); block_iter != sub_loop->block_end(); ++block_iter) {
+                    auto induction_variable = getIndexVariable(sub_loop);
+                    if (induction_variable == NULL) {
+                        return false;
+                    }
+
+                    for (auto& instruction : **block_iter) {
+                        //every array access has to be affine in the loops of the nest
+                        auto address = getLoadStorePointerOperand(&instruction);
+                        AffineAccess access;
+                        if (address != nullptr && !isNestAccess(address, induction_variable, pattern, access)) {
+                            return false;
+                        }
+                    }
+                }
+
+                return true;
+            }
+
+            bool subLoopIsVectorLoop(Loop* sub_loop, AccessPattern& pattern, std::vector<StoreInst*>& stores) {
+                auto induction_variable = getIndexVariable(sub_loop);
+                if (induction_variable == NULL) {
+                    return false;
+                }
+                
+                //every store has to store a vector indexed by the loop induction variable, the sides
+                //of an if in the body may each have their own
+                for (auto block_iter = sub_loop->block_begin(); block_iter != sub_loop->block_end(); ++block_iter) {
+                    for (auto& instruction : **block_iter) {
+                        if (auto store = dyn_cast<StoreInst>(&instruction)) {
+                            //first operand to store is value, second is address to store at
+                            //address should be the result of a getelementptr with the loop induction var as the index var
+                            auto stored_address = store->getOperand(1);
+                            stores.push_back(store);
+                            
+                            pattern.second_idx = getIndexVariable(sub_loop);
+
+                            AffineAccess access;
+                            if (!isNestAccess(stored_address, induction_variable, pattern, access) ||
+                                access.getStride(induction_variable) == 0) {
+                                return false;
+                            }
+                        }
+                    }
+                }
+
+                //since only appropriate getelementptrs were found, check if the loop iteration is independent
+                return !stores.empty() && isLoopIterationIndependent(sub_loop, pattern);
+            }
+
+            //the condition a store in the body of a sub-loop runs under, nullptr when its block runs on
+            //every iteration. Only one level of if is converted: the store has to sit in a side of an if
+            //whose branch runs on every iteration, and that side has to rejoin the body right after.
+            bool getStoreCondition(Loop* sub_loop, StoreInst* store, Value*& condition, bool& negated) {
+                auto block = store->getParent();
+                auto latch = sub_loop->getLoopLatch();
+                condition = nullptr;
+                negated = false;
+                if (latch == nullptr) {
+                    return false;
+                }
+                if (dt->dominates(block, latch)) {
+                    return true;
+                }
+
+                auto branch_block = block->getSinglePredecessor();
+                auto join = block->getSingleSuccessor();
+                if (branch_block == nullptr || join == nullptr || !dt->dominates(branch_block, latch) || !dt->dominates(join, latch)) {
+                    return false;
+                }
+                auto br = dyn_cast<BranchInst>(branch_block->getTerminator());
+                if (br == nullptr || !br->isConditional() || br->getSuccessor(0) == br->getSuccessor(1)) {
+                    return false;
+                }
+
+                condition = br->getCondition();
+                negated = br->getSuccessor(1) == block;
+                return true;
+            }
+
+            //extract what the body of a sub-loop stores, one kernel store per element it writes. A store
+            //under an if becomes a masked store, and the stores of both sides of an if/else to the same
+            //element are if-converted into a single store of a select between the two values.
+            bool extractStores(Loop* loop, Loop* body_loop, std::vector<StoreInst*>& stores, const AccessPattern& pattern,
+                               std::vector<KernelStore>& parts, ScalarEvolution& SE) {
+                std::vector<bool> merged(stores.size(), false);
+                for (unsigned int i = 0; i < stores.size(); i++) {
+                    if (merged[i]) {
+                        continue;
+                    }
+
+                    KernelStore part = {stores[i], nullptr, pattern};
+                    Value* condition = nullptr;
+                    if (!getStoreCondition(body_loop, stores[i], condition, part.negated)) {
+                        return false;
+                    }
+
+                    //the other side of the if may store to the same element
+                    int other = -1;
+                    for (unsigned int j = i + 1; j < stores.size() && condition != nullptr && other < 0; j++) {
+                        Value* other_condition = nullptr;
+                        bool other_negated = false;
+                        if (!merged[j] && getStoreCondition(body_loop, stores[j], other_condition, other_negated) &&
+                            other_condition == condition && other_negated != part.negated &&
+                            isSameElement(stores[i]->getPointerOperand(), stores[j]->getPointerOperand())) {
+                            other = j;
+                        }
+                    }
+
+                    if (other >= 0) {
+                        merged[other] = true;
+                        auto true_store = part.negated ? stores[other] : stores[i];
+                        auto false_store = part.negated ? stores[i] : stores[other];
+                        part.store = true_store;
+                        part.negated = false;
+                        part.ast = extractSelect(condition, true_store->getValueOperand(), false_store->getValueOperand(),
+                                                 true_store->getValueOperand(), pattern);
+                    }
+                    else if (condition != nullptr) {
+                        part.mask = extractComputation(condition, pattern);
+                        part.ast = part.mask != nullptr ? extractComputation(stores[i]->getValueOperand(), pattern) : nullptr;
+                    }
+                    else {
+                        part.ast = extractReduction(loop, body_loop, stores[i], pattern, SE);
+                        if (part.ast == nullptr) {
+                            part.ast = extractComputation(stores[i]->getValueOperand(), pattern);
+                        }
+                    }
+
+                    if (part.ast == nullptr) {
+                        return false;
+                    }
+                    parts.push_back(part);
+                }
+                return true;
+            }
+
+            //the kernel runs every iteration of the body loop at once while the loops around it run one
+            //after the other, so a dependence may only have a "=" at the level of the body loop. Accesses
+            //that alias analysis cannot keep apart come back from DependenceInfo confused.
+            bool isCarriedByLoop(Instruction* source, Instruction* destination, Loop* body_loop) {
+                auto dependence = di->depends(source, destination, true);
+                if (!dependence) {
+                    return false;
+                }
+                unsigned int level = body_loop->getLoopDepth();
+                if (!dependence->isConfused() && level <= dependence->getLevels() &&
+                    dependence->getDirection(level) == Dependence::DVEntry::EQ) {
+                    return false;
+                }
+
+                //it gives up on subscripts it cannot prove stay inside their dimension. With the outer
+                //indices fixed, two accesses with the same strides only meet on different iterations of
+                //the body loop when they are a multiple of its stride apart that is shorter than its range
+                auto source_address = getLoadStorePointerOperand(source);
+                auto destination_address = getLoadStorePointerOperand(destination);
+                AffineAccess source_access, destination_access;
+                if (source_address == nullptr || destination_address == nullptr || getLoadStoreType(source) != getLoadStoreType(destination) ||
+                    !getAffineAccess(source_address, source_access) || !getAffineAccess(destination_address, destination_access) ||
+                    source_access.strides != destination_access.strides) {
+                    return true;
+                }
+                auto distance = dyn_cast<SCEVConstant>(se->getMinusSCEV(destination_access.base, source_access.base));
+                int64_t stride = source_access.getStride(getIndexVariable(body_loop));
+                auto& data_layout = source->getModule()->getDataLayout();
+                if (distance == nullptr || stride == 0 || std::abs(stride) < (int64_t)data_layout.getTypeStoreSize(getLoadStoreType(source))) {
+                    return true;
+                }
+                int64_t offset = distance->getAPInt().getSExtValue();
+                LoopRange range;
+                if (offset % stride != 0) {
+                    return true;
+                }
+                return offset != 0 && (!getLoopRange(body_loop, range) || !range.constant ||
+                                       std::abs(offset / stride) < (int64_t)(range.end - range.start));
+            }
+
+            const Loop* getOutermostLoop(const Loop* loop) {
+                while (loop->getParentLoop() != nullptr) {
+                    loop = loop->getParentLoop();
+                }
+                return loop;
+            }
+
+            //first and one past the last byte an access reaches over the loops that do not contain
+            //position, the loops around position stay at their current iteration. Without a position
+            //it covers the whole nest.
+            bool getAccessExtent(Instruction* access, Instruction* position, const SCEV*& low, const SCEV*& high) {
+                auto& data_layout = access->getModule()->getDataLayout();
+                auto address = getLoadStorePointerOperand(access);
+                auto offset_type = data_layout.getIndexType(address->getType());
+                const SCEV* low_offset = se->getZero(offset_type);
+                const SCEV* high_offset = se->getConstant(offset_type, data_layout.getTypeStoreSize(getLoadStoreType(access)));
+                auto expr = se->getSCEV(address);
+                while (auto recurrence = dyn_cast<SCEVAddRecExpr>(expr)) {
+                    auto loop = recurrence->getLoop();
+                    if (position != nullptr && loop->contains(position)) {
+                        break;
+                    }
+                    auto step = dyn_cast<SCEVConstant>(recurrence->getStepRecurrence(*se));
+                    LoopRange range;
+                    if (!recurrence->isAffine() || step == nullptr || !getLoopRange(loop, range) ||
+                        !se->isLoopInvariant(range.start_expr, getOutermostLoop(loop)) ||
+                        !se->isLoopInvariant(range.end_expr, getOutermostLoop(loop))) {
+                        return false;
+                    }
+                    auto last = se->getMinusSCEV(se->getMinusSCEV(se->getNoopOrSignExtend(range.end_expr, offset_type),
+                                                                  se->getNoopOrSignExtend(range.start_expr, offset_type)),
+                                                 se->getOne(offset_type));
+                    auto reach = se->getMulExpr(se->getNoopOrSignExtend(step, offset_type), last);
+                    if (step->getAPInt().isNegative()) {
+                        low_offset = se->getAddExpr(low_offset, reach);
+                    }
+                    else {
+                        high_offset = se->getAddExpr(high_offset, reach);
+                    }
+                    expr = recurrence->getStart();
+                }
+                low = se->getAddExpr(expr, low_offset);
+                high = se->getAddExpr(expr, high_offset);
+                return true;
+            }
+
+            //a dependence that only exists because alias analysis cannot tell two different arrays
+            //apart goes away when the arrays do not overlap, which is cheap to check at runtime
+            bool isRuntimeCheckable(Instruction* first, Instruction* second, Loop* body_loop) {
+                auto first_address = getLoadStorePointerOperand(first);
+                auto second_address = getLoadStorePointerOperand(second);
+                if (first_address == nullptr || second_address == nullptr ||
+                    getUnderlyingObject(first_address) == getUnderlyingObject(second_address) ||
+                    aa->alias(MemoryLocation::getBeforeOrAfter(first_address), MemoryLocation::getBeforeOrAfter(second_address)) == AliasResult::MustAlias) {
+                    return false;
+                }
+
+                //the extents have to be computable in front of the whole nest
+                for (auto access : {first, second}) {
+                    const SCEV* low;
+                    const SCEV* high;
+                    if (!getAccessExtent(access, nullptr, low, high) || !se->isLoopInvariant(low, getOutermostLoop(body_loop)) ||
+                        !se->isLoopInvariant(high, getOutermostLoop(body_loop))) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            //a kernel with several stores writes all of them for an element at once, so the body may
+            //only read an element it stores before storing it, and may only store to an element twice
+            //on the two sides of an if. The accumulator of a reduction is only read by the reduction.
+            //Dependences between arrays that may overlap are collected into alias_checks when given.
+            bool areStoresIndependent(Loop* body_loop, std::vector<StoreInst*>& stores, std::vector<KernelStore>& parts,
+                                      std::vector<AliasCheck>* alias_checks) {
+                SmallPtrSet<BasicBlock*, 1> next_iteration;
+                next_iteration.insert(body_loop->getHeader());
+                auto isAfter = [&](Instruction* from, Instruction* to) {
+                    return isPotentiallyReachable(from, to, &next_iteration, dt, nullptr);
+                };
+
+                for (auto block : body_loop->blocks()) {
+                    for (auto& instruction : *block) {
+                        if (!instruction.mayReadOrWriteMemory()) {
+                            continue;
+                        }
+                        for (auto store : stores) {
+                            if (store == &instruction || !di->depends(store, &instruction, true)) {
+                                continue;
+                            }
+                            if (alias_checks != nullptr && isRuntimeCheckable(store, &instruction, body_loop)) {
+                                alias_checks->push_back({store, &instruction});
+                                continue;
+                            }
+                            if (isCarriedByLoop(store, &instruction, body_loop) || isAfter(store, &instruction)) {
+                                return false;
+                            }
+                        }
+                    }
+                }
+
+                for (auto& reduction : parts) {
+                    if (reduction.ast->ast_type != AST_TYPE_REDUCTION) {
+                        continue;
+                    }
+                    auto address = se->getSCEV(reduction.store->getPointerOperand());
+                    for (auto& part : parts) {
+                        if (&part != &reduction && (readsAddress(part.ast, address, *se) || readsAddress(part.mask, address, *se))) {
+                            return false;
+                        }
+                    }
+                }
+                return true;
+            }
+
+           //Loop interchange as defined here is valid when the set of vectors
+           //is being iterated over by the outer loop and the set of element
+           //accesses is being iterated over by the inner loop. For PIM, loop
+           //interchange is not valid for ">" and "<" type dependencies, it
+           //only works for "=" types (i.e. directly accessed by that iteration
+           //and independent of it). This is because inside the subloop it is
+           //effectively being vectorized, so we do not have random access ability.
+           bool isLoopInterchangeValid(Loop* loop, Loop* sub_loop, AccessPattern& pattern) {
+                //if loop iterations are not independent, no point doing interchange
+                if (!isLoopIterationIndependent(sub_loop, pattern)) {
+                    return false;
+                }
+
+                //swapping the loops must not reverse a dependence, i.e. none may be carried forward
+                //by one of them and backward by the other
+                std::vector<Instruction*> accesses;
+                for (auto block : sub_loop->blocks()) {
+                    for (auto& instruction : *block) {
+                        if (instruction.mayReadOrWriteMemory()) {
+                            accesses.push_back(&instruction);
+                        }
+                    }
+                }
+                unsigned int outer_level = loop->getLoopDepth();
+                unsigned int inner_level = sub_loop->getLoopDepth();
+                for (unsigned int i = 0; i < accesses.size(); i++) {
+                    for (unsigned int j = i; j < accesses.size(); j++) {
+                        auto dependence = di->depends(accesses[i], accesses[j], true);
+                        if (!dependence) {
+                            continue;
+                        }
+                        if (dependence->isConfused() || inner_level > dependence->getLevels()) {
+                            return false;
+                        }
+                        auto outer = dependence->getDirection(outer_level);
+                        auto inner = dependence->getDirection(inner_level);
+                        if (((outer & Dependence::DVEntry::LT) && (inner & Dependence::DVEntry::GT)) ||
+                            ((outer & Dependence::DVEntry::GT) && (inner & Dependence::DVEntry::LT))) {
+                            return false;
+                        }
+                    }
+                }
+
+                //If all stores walk consecutive elements with the index 
+                //of the outer loop, then do loop interchange
+                bool do_interchange = true;
+                for (auto block_iter = sub_loop->block_begin(); block_iter != sub_loop->block_end(); ++block_iter) {
+                    for (auto& instruction : **block_iter) {
                         if (auto store = dyn_cast<StoreInst>(&instruction)) {
-                            auto stored_address = store->getOperand(1);
-                        
-                            if (auto gep = dyn_cast<GetElementPtrInst>(stored_address)) {
-                                if (getIndexVariable(gep) != pattern.first_idx) {
-                                    do_interchange = false;
+                            auto& data_layout = store->getModule()->getDataLayout();
+                            AffineAccess access;
+                            getAffineAccess(store->getPointerOperand(), access);
+                            if (access.getStride(pattern.first_idx) != (int64_t)data_layout.getTypeStoreSize(store->getValueOperand()->getType())) {
+                                do_interchange = false;
+                            }
+                        }
+                    }
+                }
+
+                return do_interchange;
+            }
+
+            bool loop_was_interchanged = false;
+ 
+            //does not need to actually physically transform the code 
+            //since the inner loops will be deleted and replaced by
+            //a vectorized form anyway, all the loop interchange
+            //needs to do is flip the access pattern and record that 
+            //this flip happened.
+            void doLoopInterchange(Loop* loop, Loop* sub_loop, AccessPattern& pattern) {
+                report() << "[Loop Interchange] transform complete.\n"; 
+                auto x = pattern.first_idx;
+                pattern.first_idx = pattern.second_idx;
+                pattern.second_idx = x;
+                loop_was_interchanged = true;
+            }
+
+            //the range is taken from the canonical induction variable: its start is the start of
+            //the recurrence and, since the loop exits from its header, the body runs once per
+            //backedge. Bounds that are not known at compile time are kept symbolic.
+            bool getLoopRange(const Loop* loop, LoopRange& range) {
+                auto header = loop->getHeader();
+                auto induction_variable = getIndexVariable(loop);
+                if (loop->getLoopPreheader() == nullptr || induction_variable == nullptr || loop->getExitingBlock() != header) {
+                    return false;
+                }
+
+                auto br = dyn_cast<BranchInst>(header->getTerminator());
+                if (br == nullptr || !br->isConditional()) {
+                    return false;
+                }
+
+                auto recurrence = dyn_cast<SCEVAddRecExpr>(se->getSCEV(induction_variable));
+                auto trip_count = se->getBackedgeTakenCount(loop);
+                if (recurrence == nullptr || isa<SCEVCouldNotCompute>(trip_count)) {
+                    return false;
+                }
+
+                range.start_expr = recurrence->getStart();
+                range.end_expr = se->getAddExpr(range.start_expr, se->getTruncateOrZeroExtend(trip_count, range.start_expr->getType()));
+
+                auto start = dyn_cast<SCEVConstant>(range.start_expr);
+                auto end = dyn_cast<SCEVConstant>(range.end_expr);
+                range.constant = start != nullptr && end != nullptr;
+                if (range.constant) {
+                    range.start = start->getAPInt().getSExtValue();
+                    range.end = end->getAPInt().getSExtValue();
+                }
+                return true;
+            }
+
+            //materialize a range bound as the i32 the runtime takes, right before position
+            Value* expandBound(const SCEV* bound, Instruction* position) {
+                SCEVExpander expander(*se, position->getModule()->getDataLayout(), "pim.range");
+                auto value = expander.expandCodeFor(bound, bound->getType(), position);
+                IRBuilder<> builder(position);
+                return builder.CreateIntCast(value, builder.getInt32Ty(), true);
+            }
+
+            std::vector<int> getProgram(CompiledSubLoop& csl) {
+                std::vector<int> program;
+                for (unsigned int i = 0; i < csl.program_len; i++) {
+                    program.push_back(cast<ConstantInt>(csl.program->getInitializer()->getAggregateElement(i))->getSExtValue());
+                }
+                return program;
+            }
+
+            //strip-mine the range into tiles of one row of the widest operand, so every operand of
+            //a tile sits in the same bank, and deal the tiles to the banks. The last tile of every
+            //outer iteration holds the remainder. The tune cache or the autotuner may map it otherwise.
+            void tileSubLoop(Loop* loop, Loop* body_loop, CompiledSubLoop& csl) {
+                auto program = getProgram(csl);
+                unsigned int bits = pim_program_bits(program.data(), program.size());
+                unsigned int elements = csl.range.end - csl.range.start;
+                unsigned int tile_bytes = RowBytes.getNumOccurrences() > 0 ? (unsigned int)RowBytes : target.row_bytes;
+                unsigned int banks = Banks.getNumOccurrences() > 0 ? (unsigned int)Banks : target.banks;
+
+                csl.tile_elements = std::max(tile_bytes * 8 / bits, 1u);
+                csl.banks = std::min(std::max(banks, 1u), (unsigned int)PIM_MAX_BANKS);
+                tuneKernel(loop, body_loop, csl);
+
+                if (!csl.range.constant) {
+                    report() << "Strip-mined into tiles of " << csl.tile_elements << " elements over " << csl.banks << " banks\n";
+                    return;
+                }
+                report() << "Strip-mined into " << (elements + csl.tile_elements - 1) / csl.tile_elements << " tile(s) of "
+                       << csl.tile_elements << " elements";
+                if (elements % csl.tile_elements != 0 && elements > csl.tile_elements) {
+                    report() << " (last holds " << elements % csl.tile_elements << ")";
+                }
+                report() << " per outer iteration over " << csl.banks << " banks\n";
+            }
+
+            std::string getComputationKey(CompiledSubLoop& csl) {
+                std::string key;
+                raw_string_ostream os(key);
+                for (unsigned int i = 0; i < csl.stores.size(); i++) {
+                    os << (i > 0 ? ";" : "");
+                    printStore(csl.stores[i], os);
+                }
+                return os.str();
+            }
+
+            //kernels are found in the tune cache by function, computation and range, which stay the
+            //same from one build to the next as long as the loop does
+            std::string getTuneKey(CompiledSubLoop& csl) {
+                std::string key;
+                raw_string_ostream os(key);
+                os << csl.loops[0]->getHeader()->getParent()->getName() << ":" << getComputationKey(csl);
+                if (csl.range.constant) {
+                    os << " [" << csl.range.start << ", " << csl.range.end << ")";
+                }
+                else {
+                    os << " [runtime]";
+                }
+                return os.str();
+            }
+
+            //re-emit the kernel with or without packed layouts, it stays as it was when that fails
+            bool setPacking(Loop* loop, CompiledSubLoop& csl, bool pack) {
+                if (csl.pack == pack) {
+                    return true;
+                }
+                eraseKernel(csl);
+                csl.pack = pack;
+                if (emitKernel(loop, csl)) {
+                    return true;
+                }
+                csl.pack = !pack;
+                emitKernel(loop, csl);
+                return false;
+            }
+
+            void applyTuneConfig(Loop* loop, CompiledSubLoop& csl, const TuneConfig& config) {
+                setPacking(loop, csl, config.pack);
+                if (config.tile_elements > 0) {
+                    csl.tile_elements = config.tile_elements;
+                }
+                if (config.banks > 0) {
+                    csl.banks = std::min(config.banks, (unsigned int)PIM_MAX_BANKS);
+                }
+            }
+
+            void printTuneConfig(CompiledSubLoop& csl) {
+                report() << "tiles of " << csl.tile_elements << " elements over " << csl.banks << " banks";
+                if (!csl.layouts.empty()) {
+                    report() << ", " << csl.layouts.size() << " array(s) packed";
+                }
+                else if (!csl.pack) {
+                    report() << ", arrays kept in their C layout";
+                }
+                report() << "\n";
+            }
+
+            //map a kernel the way the tune cache says, or, when autotuning a kernel the cache does not
+            //have, run every candidate through the PIM model and keep the fastest, which goes into the
+            //cache. Tiles are a quarter of a row of the widest operand up to four rows, banks halve down
+            //from all of the target's, and arrays are packed or not. A runtime range is tuned at the
+            //break-even trip of the default mapping, or at its measured trip when there is a profile.
+            void tuneKernel(Loop* loop, Loop* body_loop, CompiledSubLoop& csl) {
+                if (!Autotune && TuneCache.empty()) {
+                    return;
+                }
+
+                auto key = getTuneKey(csl);
+                auto cached = tune_cache.find(key);
+                if (cached != tune_cache.end()) {
+                    applyTuneConfig(loop, csl, cached->second);
+                    report() << "Mapping from the tune cache: ";
+                    printTuneConfig(csl);
+                    return;
+                }
+                if (!Autotune) {
+                    return;
+                }
+
+                unsigned long long trip = csl.range.end - csl.range.start;
+                if (!csl.range.constant) {
+                    auto measured = profile_trips.find(body_loop);
+                    trip = measured != profile_trips.end() ? measured->second : findBreakEvenTrip(loop, body_loop, csl);
+                    trip = trip != 0 ? trip : 1ULL << 24;
+                }
+
+                TuneConfig best;
+                best.tile_elements = csl.tile_elements;
+                best.banks = csl.banks;
+                best.pack = csl.pack;
+                estimatePerformance(loop, body_loop, csl, trip);
+                best.speedup = csl.speedup;
+
+                unsigned int candidates = 1;
+                std::vector<bool> packings = {csl.pack};
+                if (!csl.layouts.empty()) {
+                    packings.push_back(!csl.pack);
+                }
+                for (bool pack : packings) {
+                    if (!setPacking(loop, csl, pack)) {
+                        continue;
+                    }
+                    auto program = getProgram(csl);
+                    unsigned long long row_elements = target.row_bytes * 8ULL / pim_program_bits(program.data(), program.size());
+                    for (unsigned int quarters : {1, 2, 4, 8, 16}) {
+                        csl.tile_elements = std::max((unsigned int)(row_elements * quarters / 4), 1u);
+                        for (unsigned int banks = std::min(target.banks, (unsigned int)PIM_MAX_BANKS); banks >= 1; banks /= 2) {
+                            csl.banks = banks;
+                            estimatePerformance(loop, body_loop, csl, trip);
+                            candidates++;
+                            if (csl.speedup > best.speedup) {
+                                best.tile_elements = csl.tile_elements;
+                                best.banks = banks;
+                                best.pack = pack;
+                                best.speedup = csl.speedup;
+                            }
+                        }
+                    }
+                }
+
+                applyTuneConfig(loop, csl, best);
+                tune_cache[key] = best;
+                tune_cache_dirty = true;
+                report() << "Autotuned over " << candidates << " mappings: ";
+                printTuneConfig(csl);
+            }
+
+            //with -autopim-area-budget a kernel is only kept when the budget was spent on its computation.
+            //While planning it becomes a candidate instead and is dropped again, so the loop stays as it
+            //is. A range only known at runtime is valued at its measured trip, or at one tile per bank.
+            bool isWithinAreaBudget(Loop* loop, CompiledSubLoop& csl) {
+                if (AreaBudget == 0 || (!planning && !budget_selected)) {
+                    return true;
+                }
+
+                auto& candidate = kernel_candidates[getComputationKey(csl)];
+                if (planning) {
+                    auto body_loop = csl.loops[0];
+                    if (!csl.range.constant && profile_trips.find(body_loop) == profile_trips.end()) {
+                        estimatePerformance(loop, body_loop, csl, std::max((unsigned long long)csl.min_trip, (unsigned long long)csl.tile_elements * csl.banks));
+                    }
+                    candidate.cost = std::max(candidate.cost, csl.cost);
+                    candidate.loops++;
+                    candidate.host_cycles += csl.host_cycles * profile_calls;
+                    candidate.saved_cycles += (csl.host_cycles - csl.pim_cycles) * profile_calls;
+                }
+                else if (candidate.selected) {
+                    return true;
+                }
+                else {
+                    report() << "Left out of the area budget, keeping it on the host.\n";
+                    remarkMissed(csl.loops[0], "OverAreaBudget", "the area budget went to kernels that save more cycles");
+                }
+                eraseKernel(csl);
+                csl.compiled = false;
+                return false;
+            }
+
+            //spend the area budget on the candidate kernels that save the most cycles, a 0/1 knapsack over
+            //their areas. Loops with the same computation share a kernel, so its area is only paid once;
+            //different kernels are not time-multiplexed on the same units since their dispatches may overlap.
+            void selectKernels() {
+                //areas are scaled down to keep the table small, rounding them up keeps the selection in budget
+                unsigned long long scale = std::max((AreaBudget + 65535ULL) / 65536, 1ULL);
+                unsigned int capacity = AreaBudget / scale;
+                std::vector<KernelCandidate*> candidates;
+                for (auto& entry : kernel_candidates) {
+                    if (entry.second.saved_cycles > 0) {
+                        candidates.push_back(&entry.second);
+                    }
+                }
+
+                std::vector<double> best(capacity + 1, 0);
+                std::vector<std::vector<bool>> taken(candidates.size(), std::vector<bool>(capacity + 1));
+                for (unsigned int i = 0; i < candidates.size(); i++) {
+                    unsigned long long area = (candidates[i]->cost + scale - 1) / scale;
+                    for (long long space = capacity; space >= (long long)area; space--) {
+                        if (best[space - area] + candidates[i]->saved_cycles > best[space]) {
+                            best[space] = best[space - area] + candidates[i]->saved_cycles;
+                            taken[i][space] = true;
+                        }
+                    }
+                }
+                unsigned long long space = capacity;
+                for (unsigned int i = candidates.size(); i-- > 0;) {
+                    if (taken[i][space]) {
+                        candidates[i]->selected = true;
+                        space -= (candidates[i]->cost + scale - 1) / scale;
+                    }
+                }
+                budget_selected = true;
+
+                //the allocation table: every candidate kernel, what it costs and what it saves over its loops
+                unsigned long long spent = 0;
+                unsigned int selected = 0;
+                double host_cycles = 0, saved_cycles = 0, saved_all = 0;
+                for (auto& entry : kernel_candidates) {
+                    auto& candidate = entry.second;
+                    host_cycles += candidate.host_cycles;
+                    saved_all += std::max(candidate.saved_cycles, 0.0);
+                    if (candidate.selected) {
+                        spent += candidate.cost;
+                        selected++;
+                        saved_cycles += candidate.saved_cycles;
+                    }
+                }
+                report() << "\n[Area Budget Report] " << selected << " of " << kernel_candidates.size() << " kernel(s) selected, "
+                         << spent << " of " << AreaBudget << " area spent\n";
+                report() << "selected       area  loops   saved cycles  kernel\n";
+                for (auto& entry : kernel_candidates) {
+                    auto& candidate = entry.second;
+                    report() << format("%-8s %10u %6u %14.0f  ", candidate.selected ? "yes" : "no", candidate.cost, candidate.loops, candidate.saved_cycles)
+                             << entry.first << "\n";
+                }
+                if (host_cycles > 0) {
+                    report() << "Predicted speedup of the candidate loops: " << format("%.2fx", host_cycles / (host_cycles - saved_cycles))
+                             << ", " << format("%.2fx", host_cycles / (host_cycles - saved_all)) << " without a budget\n";
+                }
+            }
+
+            //with the tune cache or the autotuner, a fused kernel has to beat its sub-loops on their own,
+            //on the PIM unit or on the host when they stay there. Runtime ranges are predicted at their
+            //own break-even trips, so those are not compared and stay fused.
+            bool isFusionProfitable(CompiledSubLoop& first, CompiledSubLoop& second, CompiledSubLoop& fused) {
+                if (!Autotune && TuneCache.empty()) {
+                    return true;
+                }
+
+                auto key = getTuneKey(fused);
+                if (!Autotune) {
+                    auto cached = tune_cache.find(key);
+                    return cached == tune_cache.end() || cached->second.fuse;
+                }
+                if (!fused.range.constant) {
+                    return true;
+                }
+
+                auto getCycles = [](CompiledSubLoop& csl) {
+                    return csl.compiled ? csl.pim_cycles : csl.host_cycles;
+                };
+                bool fuse = fused.pim_cycles < getCycles(first) + getCycles(second);
+                tune_cache[key].fuse = fuse;
+                tune_cache_dirty = true;
+                return fuse;
+            }
+
+            //the tune cache is a JSON object from tune key to the mapping of the kernel. A missing file
+            //is an empty cache, the first autotuning build writes it.
+            void loadTuneCache() {
+                auto buffer = MemoryBuffer::getFile(TuneCache);
+                if (!buffer) {
+                    return;
+                }
+                auto parsed = json::parse((*buffer)->getBuffer());
+                if (!parsed) {
+                    report() << "Error while reading the tune cache " << TuneCache << ": " << toString(parsed.takeError()) << "\n";
+                    return;
+                }
+                auto root = parsed->getAsObject();
+                if (root == nullptr) {
+                    report() << "Error while reading the tune cache " << TuneCache << ": not an object\n";
+                    return;
+                }
+
+                for (auto& entry : *root) {
+                    auto object = entry.second.getAsObject();
+                    if (object == nullptr) {
+                        continue;
+                    }
+                    TuneConfig config;
+                    config.tile_elements = object->getInteger("tile_elements").getValueOr(0);
+                    config.banks = object->getInteger("banks").getValueOr(0);
+                    config.pack = object->getBoolean("pack").getValueOr(true);
+                    config.fuse = object->getBoolean("fuse").getValueOr(true);
+                    config.speedup = object->getNumber("speedup").getValueOr(0);
+                    tune_cache[entry.first.str()] = config;
+                }
+            }
+
+            void saveTuneCache() {
+                json::Object root;
+                for (auto& entry : tune_cache) {
+                    root[entry.first] = json::Object{{"tile_elements", (int64_t)entry.second.tile_elements},
+                                                     {"banks", (int64_t)entry.second.banks},
+                                                     {"pack", entry.second.pack},
+                                                     {"fuse", entry.second.fuse},
+                                                     {"speedup", entry.second.speedup}};
+                }
+
+                std::error_code error;
+                raw_fd_ostream file(TuneCache, error);
+                if (error) {
+                    report() << "Error while writing the tune cache " << TuneCache << ": " << error.message() << "\n";
+                    return;
+                }
+                file << formatv("{0:2}", json::Value(std::move(root))) << "\n";
+                tune_cache_dirty = false;
+            }
+
+            //read the target description, fields it leaves out keep the defaults of pimmodel.h and
+            //the CostModel. The format is in the README.
+            bool loadTarget() {
+                auto buffer = MemoryBuffer::getFile(TargetFile);
+                if (!buffer) {
+                    report() << "Error while loading the target " << TargetFile << ": " << buffer.getError().message() << "\n";
+                    return false;
+                }
+                auto parsed = json::parse((*buffer)->getBuffer());
+                if (!parsed) {
+                    report() << "Error while loading the target " << TargetFile << ": " << toString(parsed.takeError()) << "\n";
+                    return false;
+                }
+                auto root = parsed->getAsObject();
+                if (root == nullptr) {
+                    report() << "Error while loading the target " << TargetFile << ": not an object\n";
+                    return false;
+                }
+
+                auto readUnsigned = [](const json::Object* object, StringRef name, unsigned int& field) {
+                    if (object != nullptr) {
+                        if (auto value = object->getInteger(name)) {
+                            field = *value;
+                        }
+                    }
+                };
+                auto readDouble = [](const json::Object* object, StringRef name, double& field) {
+                    if (object != nullptr) {
+                        if (auto value = object->getNumber(name)) {
+                            field = *value;
+                        }
+                    }
+                };
+
+                pim_target loaded = target;
+                readUnsigned(root, "banks", loaded.banks);
+                readUnsigned(root, "row_bytes", loaded.row_bytes);
+                readUnsigned(root, "clock_mhz", loaded.clock_mhz);
+
+                auto cycles = root->getObject("cycles");
+                readUnsigned(cycles, "activate", loaded.activate_cycles);
+                readUnsigned(cycles, "rowop", loaded.rowop_cycles);
+                readUnsigned(cycles, "dispatch", loaded.dispatch_cycles);
+                readUnsigned(cycles, "command", loaded.command_cycles);
+                readUnsigned(cycles, "transpose", loaded.transpose_cycles);
+
+                auto energy = root->getObject("energy_nj");
+                readDouble(energy, "activate", loaded.activate_nj);
+                readDouble(energy, "rowop", loaded.rowop_nj);
+                readDouble(energy, "dispatch", loaded.dispatch_nj);
+
+                auto host = root->getObject("host");
+                readDouble(host, "bytes_per_cycle", loaded.host_bytes_per_cycle);
+                readDouble(host, "cycle_nj", loaded.host_cycle_nj);
+                readDouble(host, "byte_nj", loaded.host_byte_nj);
+
+                //a row operation of a single micro-op, by its lower case name
+                for (int op = PIM_OP_ADD; op < PIM_NUM_OPS; op++) {
+                    auto name = StringRef(getMicroOpName(op)).lower();
+                    readUnsigned(cycles, name, loaded.op_cycles[op]);
+                    readDouble(energy, name, loaded.op_nj[op]);
+                }
+
+                if (loaded.banks == 0 || loaded.banks > PIM_MAX_BANKS || loaded.row_bytes == 0 || loaded.clock_mhz == 0 ||
+                    loaded.host_bytes_per_cycle <= 0) {
+                    report() << "Error while loading the target " << TargetFile << ": banks, row_bytes, clock_mhz or host bytes_per_cycle out of range\n";
+                    return false;
+                }
+
+                //the units the pass builds kernels from, the select and transpose units are made of
+                //and/or gates unless given
+                auto area = root->getObject("area");
+                CostModel model;
+                readUnsigned(area, "add", model.cost_add);
+                readUnsigned(area, "sub", model.cost_sub);
+                readUnsigned(area, "mul", model.cost_mul);
+                readUnsigned(area, "div", model.cost_div);
+                readUnsigned(area, "shift", model.cost_shift);
+                readUnsigned(area, "and", model.cost_and);
+                readUnsigned(area, "or", model.cost_or);
+                readUnsigned(area, "xor", model.cost_xor);
+                readUnsigned(area, "load", model.cost_load);
+                readUnsigned(area, "cmp", model.cost_cmp);
+                readUnsigned(area, "constant", model.cost_constant);
+                model.cost_transpose = 32 * (model.cost_and + model.cost_or);
+                model.cost_select = 2 * model.cost_and + model.cost_or;
+                readUnsigned(area, "transpose", model.cost_transpose);
+                readUnsigned(area, "select", model.cost_select);
+
+                target = loaded;
+                area_model = model;
+                custom_target = true;
+                report() << "Target " << TargetFile << ": " << target.banks << " banks of " << target.row_bytes << " byte rows at "
+                       << target.clock_mhz << " MHz\n";
+                return true;
+            }
+
+            //predict how the compiled loop compares to the host. The PIM side runs the program
+            //through the DRAM model with the dispatches it will get: one covering the outer range
+            //when it can be batched, one per outer iteration otherwise, plus the layout conversions.
+            //The host side is the TTI latency of the loop body plus streaming the bytes it accesses.
+            //An outer range only known at runtime is costed as a single outer iteration.
+            void estimatePerformance(Loop* loop, Loop* body_loop, CompiledSubLoop& csl, unsigned long long inner_count) {
+                unsigned long long outer_count = 1;
+                unsigned long long dispatches = 1;
+                unsigned long long outer_per_dispatch = 1;
+                LoopRange outer_range;
+                if (loop != body_loop) {
+                    if (getLoopRange(loop, outer_range) && outer_range.constant && outer_range.end > outer_range.start) {
+                        outer_count = outer_range.end - outer_range.start;
+                    }
+                    if (BatchDispatch && isBatchDispatchValid(loop, csl.loops, outer_range)) {
+                        outer_per_dispatch = outer_count;
+                    }
+                    else {
+                        dispatches = outer_count;
+                    }
+                }
+
+                auto program = getProgram(csl);
+                pim_estimate dispatch = {};
+                pim_estimate_program(&target, program.data(), program.size(), inner_count, outer_per_dispatch, csl.tile_elements, csl.banks, &dispatch);
+                pim_estimate_dispatch(&target, 1, &dispatch);
+                pim_estimate pim = {};
+                for (auto& array_layout : csl.layouts) {
+                    pim_estimate_pack(&target, array_layout.elements, array_layout.element_bits, array_layout.packed_bits, &pim);
+                    pim_estimate_dispatch(&target, 1, &pim);
+                }
+                double pim_cycles = pim.cycles + (double)dispatch.cycles * dispatches;
+                double pim_energy = pim.energy_nj + dispatch.energy_nj * dispatches;
+
+                auto& data_layout = body_loop->getHeader()->getModule()->getDataLayout();
+                double iteration_cycles = 0;
+                double iteration_bytes = 0;
+                for (auto sub_loop : csl.loops) {
+                    for (auto block : sub_loop->blocks()) {
+                        for (auto& instruction : *block) {
+                            auto cost = tti->getInstructionCost(&instruction, TargetTransformInfo::TCK_Latency).getValue();
+                            iteration_cycles += cost.hasValue() ? *cost : 1;
+                            if (auto load = dyn_cast<LoadInst>(&instruction)) {
+                                iteration_bytes += data_layout.getTypeStoreSize(load->getType());
+                            }
+                            else if (auto store = dyn_cast<StoreInst>(&instruction)) {
+                                iteration_bytes += data_layout.getTypeStoreSize(store->getValueOperand()->getType());
+                            }
+                        }
+                    }
+                }
+
+                double iterations = (double)inner_count * outer_count;
+                double host_cycles = iterations * (iteration_cycles + iteration_bytes / target.host_bytes_per_cycle);
+                double host_energy = host_cycles * target.host_cycle_nj + iterations * iteration_bytes * target.host_byte_nj;
+
+                csl.pim_cycles = pim_cycles;
+                csl.host_cycles = host_cycles;
+                csl.speedup = pim_cycles > 0 ? host_cycles / pim_cycles : 0;
+                csl.energy = host_energy > 0 ? pim_energy / host_energy : 0;
+                csl.bytes_moved = pim.bytes_moved + dispatch.bytes_moved * dispatches;
+            }
+
+            //shortest trip count the model predicts a speedup above the threshold for, 0 if there is
+            //none up to 2^24. Longer ranges amortize the dispatch better, so the first power of two
+            //that pays off bounds a binary search. Leaves the estimate at the break-even point in csl.
+            unsigned int findBreakEvenTrip(Loop* loop, Loop* body_loop, CompiledSubLoop& csl) {
+                const unsigned long long max_trip = 1ULL << 24;
+                unsigned long long high = 1;
+                while (true) {
+                    estimatePerformance(loop, body_loop, csl, high);
+                    if (csl.speedup > MinSpeedup) {
+                        break;
+                    }
+                    if (high >= max_trip) {
+                        return 0;
+                    }
+                    high *= 2;
+                }
+
+                unsigned long long low = high / 2;
+                while (low + 1 < high) {
+                    unsigned long long middle = (low + high) / 2;
+                    estimatePerformance(loop, body_loop, csl, middle);
+                    if (csl.speedup > MinSpeedup) {
+                        high = middle;
+                    }
+                    else {
+                        low = middle;
+                    }
+                }
+                estimatePerformance(loop, body_loop, csl, high);
+                return high;
+            }
+
+            //rewrite the values and masks of the stores before the kernel is emitted and costed,
+            //returns how much area that saves
+            unsigned int rewriteStores(std::vector<KernelStore>& parts) {
+                if (!RewriteAST) {
+                    return 0;
+                }
+
+                CostModel original = area_model;
+                CostModel rewritten = area_model;
+                unsigned int original_cost = 0;
+                unsigned int rewritten_cost = 0;
+                for (auto& part : parts) {
+                    original_cost += original.computeStoreCost(part);
+                    part.ast = rewriteAST(part.ast);
+                    part.mask = rewriteAST(part.mask);
+                    rewritten_cost += rewritten.computeStoreCost(part);
+                }
+                return original_cost > rewritten_cost ? original_cost - rewritten_cost : 0;
+            }
+
+            //check that the loop stores a vector computed from arrays and constants only, and
+            //lower that computation into a kernel. loop is the loop nest whose invariant values
+            //are passed to the kernel as operands.
+            bool compileLoopBody(Loop* loop, Loop* body_loop, AccessPattern& pattern, CompiledSubLoop& csl, ScalarEvolution& SE) {
+                std::vector<StoreInst*> stores;
+                if (!subLoopIsVectorLoop(body_loop, pattern, stores)) {
+                    return remarkMissed(body_loop, "NotVectorLoop", "stores are not affine in the loop nest with a stride along the loop");
+                }
+
+                if (!getLoopRange(body_loop, csl.range)) {
+                    return remarkMissed(body_loop, "UnknownRange", "the range of the loop cannot be computed");
+                }
+
+                std::vector<KernelStore> parts;
+                if (!extractStores(loop, body_loop, stores, pattern, parts, SE)) {
+                    return remarkMissed(body_loop, "UnsupportedComputation", "a stored value is not computed from arrays and constants with PIM operations");
+                }
+                if (!areStoresIndependent(body_loop, stores, parts, RuntimeChecks ? &csl.alias_checks : nullptr)) {
+                    return remarkMissed(body_loop, "LoopCarriedDependence", "a dependence is carried by the loop, or its arrays may alias");
+                }
+                csl.rewrite_saving = rewriteStores(parts);
+
+                csl.kernel_num = kernel_count++;
+                csl.stores = parts;
+                csl.loops.push_back(body_loop);
+                if (!emitKernel(loop, csl)) {
+                    csl.stores.clear();
+                    return remarkMissed(body_loop, "KernelNotEmitted", "the kernel could not be emitted");
+                }
+
+                report() << "can be done.\n";
+                for (auto& part : csl.stores) {
+                    if (part.ast->ast_type == AST_TYPE_REDUCTION) {
+                        report() << "Reduction over the outer loop: " << getReductionName(part.ast->reduction) << "\n";
+                    }
+                }
+                evaluateKernel(loop, body_loop, csl);
+                return true;
+            }
+
+            //report a freshly emitted kernel, cost it and decide whether it is worth offloading
+            void evaluateKernel(Loop* loop, Loop* body_loop, CompiledSubLoop& csl) {
+                report() << "Compiled: sub_loop_fn" << csl.kernel_num << "\n";
+                report() << "define sub_loop_fn" << csl.kernel_num << " =";
+                for (unsigned int i = 0; i < csl.stores.size(); i++) {
+                    report() << (i > 0 ? ";" : "");
+                    printStore(csl.stores[i], report());
+                }
+                report() << "\n";
+                if (csl.forwarded > 0) {
+                    report() << "Forwarded " << csl.forwarded << " load(s) from earlier stores of the kernel through the row buffer\n";
+                }
+                for (auto& array_layout : csl.layouts) {
+                    report() << "Array layout: " << array_layout.base->getName() << " packed ";
+                    if (array_layout.layout == PIM_LAYOUT_VERTICAL) {
+                        report() << "bit-transposed (" << array_layout.packed_bits << " of " << array_layout.element_bits << " bits)";
+                    }
+                    else {
+                        report() << "column-major";
+                    }
+                    report() << ", " << array_layout.elements << " elements\n";
+                }
+
+                CostModel cm = area_model;
+                csl.cost = 0;
+                for (auto& part : csl.stores) {
+                    csl.cost += cm.computeStoreCost(part);
+                }
+                if (csl.rewrite_saving > 0) {
+                    report() << "Rewritten into cheaper PIM operations, saving " << csl.rewrite_saving << " area\n";
+                }
+
+                //loops the PIM unit would not speed up stay on the host, when the range is only known
+                //at runtime the dispatch is guarded by a check against the shortest range that pays off.
+                //Tuning may leave the arrays unpacked, so the transpose unit is only costed after it.
+                tileSubLoop(loop, body_loop, csl);
+                csl.cost += cm.computeLayoutCost(csl.layouts);
+                if (csl.range.constant) {
+                    estimatePerformance(loop, body_loop, csl, csl.range.end - csl.range.start);
+                    csl.compiled = csl.speedup > MinSpeedup;
+                }
+                else {
+                    csl.min_trip = findBreakEvenTrip(loop, body_loop, csl);
+                    csl.compiled = csl.min_trip != 0;
+
+                    //the guard still checks every dispatch, the profile tells whether the ranges
+                    //the loop really runs over pay off
+                    auto measured = profile_trips.find(body_loop);
+                    if (csl.compiled && measured != profile_trips.end()) {
+                        report() << "Measured average trip count: " << measured->second << "\n";
+                        estimatePerformance(loop, body_loop, csl, measured->second);
+                        csl.compiled = csl.speedup > MinSpeedup;
+                    }
+                }
+                csl.op_counts.clear();
+                for (auto insn : getProgram(csl)) {
+                    csl.op_counts[getMicroOpName(PIM_INSN_OP(insn))]++;
+                }
+                if (!csl.compiled) {
+                    eraseKernel(csl);
+                }
+            }
+
+            const char* getMicroOpName(int op) {
+                switch (op) {
+                    case PIM_OP_LOAD: return "LOAD";
+                    case PIM_OP_STORE: return "STORE";
+                    case PIM_OP_CONSTANT: return "CONSTANT";
+                    case PIM_OP_ADD: return "ADD";
+                    case PIM_OP_SUB: return "SUB";
+                    case PIM_OP_MUL: return "MUL";
+                    case PIM_OP_DIV: return "DIV";
+                    case PIM_OP_AND: return "AND";
+                    case PIM_OP_OR: return "OR";
+                    case PIM_OP_XOR: return "XOR";
+                    case PIM_OP_SHIFT: return "SHIFT";
+                    case PIM_OP_CMP: return "CMP";
+                    case PIM_OP_MIN: return "MIN";
+                    case PIM_OP_MAX: return "MAX";
+                    case PIM_OP_SELECT: return "SELECT";
+                    default: return "NOP";
+                }
+            }
+
+            void eraseKernel(CompiledSubLoop& csl) {
+                if (csl.kernel != nullptr) {
+                    csl.kernel->eraseFromParent();
+                    csl.program->eraseFromParent();
+                    csl.kernel = nullptr;
+                    csl.program = nullptr;
+                }
+            }
+
+            void printCost(const char* what, CompiledSubLoop& csl) {
+                report() << what << " function area cost (approx.): " << csl.cost << ", predicted speedup: "
+                       << format("%.2fx", csl.speedup) << ", energy: " << format("%.2fx", csl.energy) << "\n";
+                if (!csl.compiled) {
+                    report() << "Not profitable (threshold " << format("%.2fx", (double)MinSpeedup) << "), keeping it on the host.\n";
+                    emitRemark([&]() {
+                        OptimizationRemarkMissed remark(DEBUG_TYPE, "NotProfitable", csl.loops[0]->getStartLoc(), csl.loops[0]->getHeader());
+                        remark << "predicted speedup below the threshold of " << ore::NV("Threshold", formatRatio(MinSpeedup));
+                        addKernelArgs(remark, csl);
+                        return remark;
+                    });
+                }
+                else if (!csl.range.constant) {
+                    report() << "Range only known at runtime, offloaded from " << csl.min_trip << " iterations on.\n";
+                }
+                if (csl.compiled && !csl.alias_checks.empty()) {
+                    report() << "Arrays may alias, dispatched behind " << csl.alias_checks.size() << " runtime overlap check(s).\n";
+                }
+            }
+
+            //structured counterparts of the report for -pass-remarks-output: one record per loop with the
+            //decision, the reason a loop stays on the host, and what the model predicted for its kernel.
+            //Like the report they are left out while planning, the loops are reported once transformed.
+            template <typename RemarkBuilder>
+            void emitRemark(RemarkBuilder builder) {
+                if (!planning) {
+                    ore->emit(builder);
+                }
+            }
+
+            bool remarkMissed(Loop* loop, StringRef name, StringRef reason) {
+                emitRemark([&]() {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, name, loop->getStartLoc(), loop->getHeader()) << reason;
+                });
+                return false;
+            }
+
+            std::string formatRatio(double ratio) {
+                std::string text;
+                raw_string_ostream(text) << format("%.2f", ratio);
+                return text;
+            }
+
+            template <typename RemarkT>
+            void addKernelArgs(RemarkT& remark, CompiledSubLoop& csl) {
+                remark << ": area cost " << ore::NV("AreaCost", csl.cost) << ", predicted speedup " << ore::NV("Speedup", formatRatio(csl.speedup))
+                       << ", energy " << ore::NV("Energy", formatRatio(csl.energy)) << ", bytes moved " << ore::NV("BytesMoved", csl.bytes_moved)
+                       << ", micro-ops";
+                for (auto& op_count : csl.op_counts) {
+                    remark << " " + op_count.first + ":" << ore::NV(op_count.first, op_count.second);
+                }
+            }
+
+            //the report line for the dispatch that was actually inserted, the remark carries the same kind
+            void reportDispatch(CompiledSubLoop& csl, StringRef dispatch) {
+                report() << "Dispatch (" << dispatch << "): ";
+                if (dispatch == "batched") {
+                    report() << "pim_runrange(sub_loop_fn" << csl.kernel_num << ", outer range); " << (AsyncDispatch ? "ticket = pim_submit()" : "pim_flush()");
+                }
+                else {
+                    report() << (AsyncDispatch ? "ticket = pim_launch" : "pim_runindex") << "(sub_loop_fn" << csl.kernel_num << ", index)";
+                }
+                if (isGuarded(csl)) {
+                    report() << " behind a runtime check, the host loop is kept";
+                }
+                report() << "\n";
+            }
+
+            void remarkOffloaded(CompiledSubLoop& csl, StringRef dispatch) {
+                reportDispatch(csl, dispatch);
+                emitRemark([&]() {
+                    OptimizationRemark remark(DEBUG_TYPE, "Offloaded", csl.loops[0]->getStartLoc(), csl.loops[0]->getHeader());
+                    remark << "offloaded as sub_loop_fn" << ore::NV("Kernel", csl.kernel_num) << " with " << ore::NV("Dispatch", dispatch)
+                           << " dispatch covering " << ore::NV("Loops", (unsigned int)csl.loops.size()) << " loop(s)";
+                    if (!csl.range.constant) {
+                        remark << " from " << ore::NV("MinTrip", csl.min_trip) << " iterations on";
+                    }
+                    if (!csl.alias_checks.empty()) {
+                        remark << " behind " << ore::NV("AliasChecks", (unsigned int)csl.alias_checks.size()) << " overlap check(s)";
+                    }
+                    addKernelArgs(remark, csl);
+                    return remark;
+                });
+            }
+
+            void compileSubLoop(Loop* loop, Loop* sub_loop, int sub_loop_num,  AccessPattern& pattern, ScalarEvolution& SE) {
+                report() << "[Sub-Loop Processing Report]\n";
+                report() << "Loop interchange";
+
+                if (isLoopInterchangeValid(loop, sub_loop, pattern)) {
+                    report() << " is required.\n";
+                }
+                else {
+                    report() << " is not required.\n";
+                }
+
+                report() << "PIM compile ";
+                CompiledSubLoop csl;
+                csl.sub_loop_index = sub_loop_num;
+                if (compileLoopBody(loop, sub_loop, pattern, csl, SE)) {
+                    printCost("Sub-loop", csl);
+                }
+                else {
+                    report() << " cannot be done.\n";
+                }
+                sub_loops[sub_loop_num] = csl;
+            }
+
+            //straight-line code between two sibling sub-loops that touches no memory, so the second
+            //one can run right after the first
+            bool areAdjacent(Loop* first, Loop* second) {
+                auto block = first->getExitBlock();
+                auto preheader = second->getLoopPreheader();
+                while (block != nullptr) {
+                    for (auto& instruction : *block) {
+                        if (instruction.mayReadOrWriteMemory() || instruction.mayHaveSideEffects()) {
+                            return false;
+                        }
+                    }
+                    if (block == preheader) {
+                        return true;
+                    }
+                    block = block->getUniqueSuccessor();
+                }
+                return false;
+            }
+
+            //sub-loops can share a kernel when they cover the same range back to back and every
+            //dependence between them is on the same element, i.e. of the "=" type that
+            //isLoopInterchangeValid requires as well. Running the second right after the first
+            //for every element then sees exactly what it saw after the whole first loop.
+            bool isFusionValid(CompiledSubLoop& first, CompiledSubLoop& second) {
+                if (first.stores.empty() || second.stores.empty() ||
+                    first.range.start_expr != second.range.start_expr || first.range.end_expr != second.range.end_expr ||
+                    first.stores[0].pattern.first_idx != second.stores[0].pattern.first_idx ||
+                    !areAdjacent(first.loops.back(), second.loops[0])) {
+                    return false;
+                }
+                for (auto csl : {&first, &second}) {
+                    for (auto& part : csl->stores) {
+                        if (part.ast->ast_type == AST_TYPE_REDUCTION) {
+                            return false;
+                        }
+                    }
+                }
+
+                auto collectAccesses = [](CompiledSubLoop& csl, std::vector<Instruction*>& accesses) {
+                    for (auto sub_loop : csl.loops) {
+                        for (auto block : sub_loop->blocks()) {
+                            for (auto& instruction : *block) {
+                                if (instruction.mayReadOrWriteMemory()) {
+                                    accesses.push_back(&instruction);
                                 }
                             }
                         }
                     }
+                };
+                std::vector<Instruction*> first_accesses;
+                std::vector<Instruction*> second_accesses;
+                collectAccesses(first, first_accesses);
+                collectAccesses(second, second_accesses);
+
+                for (auto a : first_accesses) {
+                    for (auto b : second_accesses) {
+                        if ((!isa<LoadInst>(a) && !isa<StoreInst>(a)) || (!isa<LoadInst>(b) && !isa<StoreInst>(b))) {
+                            return false;
+                        }
+                        if (isa<LoadInst>(a) && isa<LoadInst>(b)) {
+                            continue;
+                        }
+                        auto address_a = getLoadStorePointerOperand(a);
+                        auto address_b = getLoadStorePointerOperand(b);
+                        if (mayShareMemory(address_a, address_b) && !isSameElement(address_a, address_b)) {
+                            return false;
+                        }
+                    }
                 }
+                return true;
+            }
 
-                return do_interchange;
+            //merge runs of adjacent sub-loops into one kernel, so intermediate arrays stay in the row
+            //buffers instead of being written back and read in again, and one dispatch covers them
+            void fuseSubLoops(Loop* loop, int sub_loop_num_max) {
+                int group = 0;
+                for (int idx = 1; idx < sub_loop_num_max; idx++) {
+                    auto& first = sub_loops[group];
+                    auto& second = sub_loops[idx];
+                    if (!isFusionValid(first, second)) {
+                        group = idx;
+                        continue;
+                    }
+
+                    report() << "[Sub-Loop Fusion Report]\n";
+                    report() << "Sub-loops " << first.sub_loop_index << " to " << idx << " share their range and only have \"=\" dependences.\n";
+                    CompiledSubLoop csl;
+                    csl.sub_loop_index = first.sub_loop_index;
+                    csl.range = first.range;
+                    csl.stores = first.stores;
+                    csl.stores.insert(csl.stores.end(), second.stores.begin(), second.stores.end());
+                    csl.loops = first.loops;
+                    csl.loops.insert(csl.loops.end(), second.loops.begin(), second.loops.end());
+                    csl.alias_checks = first.alias_checks;
+                    csl.alias_checks.insert(csl.alias_checks.end(), second.alias_checks.begin(), second.alias_checks.end());
+                    csl.rewrite_saving = first.rewrite_saving + second.rewrite_saving;
+                    csl.kernel_num = kernel_count++;
+                    if (!emitKernel(loop, csl)) {
+                        report() << "Fused kernel cannot be done.\n";
+                        group = idx;
+                        continue;
+                    }
+
+                    evaluateKernel(loop, csl.loops[0], csl);
+                    if (!csl.compiled) {
+                        report() << "Fused function predicted speedup: " << format("%.2fx", csl.speedup) << ", keeping the sub-loops separate.\n";
+                        group = idx;
+                        continue;
+                    }
+                    if (!isFusionProfitable(first, second, csl)) {
+                        report() << "Fused function predicted slower than the sub-loops on their own, keeping them separate.\n";
+                        eraseKernel(csl);
+                        group = idx;
+                        continue;
+                    }
+                    printCost("Fused", csl);
+                    eraseKernel(first);
+                    eraseKernel(second);
+                    second.compiled = false;
+                    second.fused = true;
+                    first = csl;
+                }
             }
 
-            bool loop_was_interchanged = false;
- 
-            //does not need to actually physically transform the code 
-            //since the inner loops will be deleted and replaced by
-            //a vectorized form anyway, all the loop interchange
-            //needs to do is flip the access pattern and record that 
-            //this flip happened.
-            void doLoopInterchange(Loop* loop, Loop* sub_loop, AccessPattern& pattern) {
-                outs() << "[Loop Interchange] transform complete.\n"; 
-                auto x = pattern.first_idx;
-                pattern.first_idx = pattern.second_idx;
-                pattern.second_idx = x;
-                loop_was_interchanged = true;
+            //check if an instruction is a memeber of a certain basic block
+            bool isInstructionInBasicBlock(Instruction* instr, BasicBlock* bb) {
+                for (auto& instruction : *bb) {
+                    if (instr == &instruction) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            //erase is valid as long as there isn't something in the loop that is from
+            //outside the loop, minus the array accesses
+            bool isEraseSubLoopValid(Loop* loop, DominatorTree& DT) {
+                auto header = loop->getHeader();
+                auto exit = loop->getExitBlock();
+
+                BasicBlock* block = nullptr;
+                for (auto succ_iter = succ_begin(header); succ_iter != succ_end(header); ++succ_iter) {
+                    if (*succ_iter != exit) {
+                        block = *succ_iter;
+                        break;
+                    }
+                }
+
+                BasicBlockEdge bbe(loop->getHeader(), block);
+
+                for (auto& instr : *block) {
+                    for (int i = 0; i < instr.getNumOperands(); i++) {
+                        auto& u = instr.getOperandUse(i);
+                        if (isa<GetElementPtrInst>(instr) || isa<StoreInst>(instr) || isa<LoadInst>(instr)) {
+                            continue;
+                        }
+                        
+                        if (!DT.dominates(bbe, u)) {
+                            return false;
+                        }
+                    }
+                }
+                
+                return true;
+            }
+    
+            //every sub-loop the kernel replaces has to be erasable
+            bool isEraseKernelValid(CompiledSubLoop& csl, DominatorTree& DT) {
+                for (auto member : csl.loops) {
+                    if (!isEraseSubLoopValid(member, DT)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            //runtime.h only declares the runtime functions, so they may not be
+            //present in the module yet
+            FunctionCallee getRuntimeFunction(Module* module, StringRef name) {
+                auto& context = module->getContext();
+                auto i32 = Type::getInt32Ty(context);
+                auto i64 = Type::getInt64Ty(context);
+                auto operands_type = Type::getInt8PtrTy(context)->getPointerTo();
+
+                if (name == "pim_runindex") {
+                    return module->getOrInsertFunction(name, i32, i32, i32, operands_type);
+                }
+                else if (name == "pim_runrange") {
+                    return module->getOrInsertFunction(name, i32, i32, i32, i32, operands_type);
+                }
+                else if (name == "pim_launch") {
+                    return module->getOrInsertFunction(name, i32, i32, i32, operands_type);
+                }
+                else if (name == "pim_flush" || name == "pim_submit") {
+                    return module->getOrInsertFunction(name, i32);
+                }
+                else if (name == "pim_wait" || name == "pim_profileenter" || name == "pim_profileexit") {
+                    return module->getOrInsertFunction(name, i32, i32);
+                }
+                else if (name == "pim_pack") {
+                    return module->getOrInsertFunction(name, i32, Type::getInt8PtrTy(context), i32, i32, i32, i32);
+                }
+                else if (name == "pim_unpack" || name == "pim_settarget") {
+                    return module->getOrInsertFunction(name, i32, Type::getInt8PtrTy(context));
+                }
+                else if (name == "pim_profileloop") {
+                    return module->getOrInsertFunction(name, i32, Type::getInt8PtrTy(context));
+                }
+                else if (name == "pim_profileiterations") {
+                    return module->getOrInsertFunction(name, i32, i32, i64);
+                }
+                else if (name == "pim_hostrange") {
+                    auto host_type = FunctionType::get(Type::getVoidTy(context), {i64, i64, operands_type}, false);
+                    return module->getOrInsertFunction(name, i32, host_type->getPointerTo(), i32, i32, operands_type);
+                }
+                else if (name == "pim_registerkernel") {
+                    auto kernel_type = FunctionType::get(Type::getVoidTy(context), {i64, i64, operands_type}, false);
+                    return module->getOrInsertFunction(name, i32, kernel_type->getPointerTo(), i32->getPointerTo(), i32);
+                }
+                return module->getOrInsertFunction(name, i32, i32, i32, i32);
+            }
+
+            //fill in the operands array for a kernel right before it is dispatched, the array
+            //itself lives in the entry block so it is not reallocated on every iteration
+            Value* insertOperandsArray(const std::vector<Value*>& operands, IRBuilder<>& builder) {
+                auto i8ptr = builder.getInt8PtrTy();
+                if (operands.empty()) {
+                    return ConstantPointerNull::get(i8ptr->getPointerTo());
+                }
+
+                auto function = builder.GetInsertBlock()->getParent();
+                IRBuilder<> entry_builder(&*function->getEntryBlock().getFirstInsertionPt());
+                auto array_type = ArrayType::get(i8ptr, operands.size());
+                auto array = entry_builder.CreateAlloca(array_type, nullptr, "pim_operands");
+
+                for (unsigned int i = 0; i < operands.size(); i++) {
+                    auto operand = operands[i];
+                    Value* operand_v = operand->getType()->isPointerTy() ? builder.CreateBitCast(operand, i8ptr)
+                                                                         : builder.CreateIntToPtr(operand, i8ptr);
+                    builder.CreateStore(operand_v, builder.CreateConstInBoundsGEP2_32(array_type, array, 0, i));
+                }
+                return builder.CreateConstInBoundsGEP2_32(array_type, array, 0, 0);
+            }
+
+            //insert PIM calls in the subloop header to trigger pim computations
+            //of the form pim_runindex(subloop_num, num, operands), or ticket = pim_launch(...)
+            //when dispatching asynchronously
+            CallInst* insertSubLoopPIMCall(Loop* sub_loop, CompiledSubLoop& csl, Value* outer_iv) {
+                auto header = sub_loop->getHeader();
+                auto runindex_fn = getRuntimeFunction(header->getParent()->getParent(), AsyncDispatch ? "pim_launch" : "pim_runindex");
+
+                IRBuilder<> builder(header->getFirstNonPHI());
+                Value* subloop_num_v = loadKernelHandle(builder, csl);
+                Value* outer_v = outer_iv ? builder.CreateIntCast(outer_iv, builder.getInt32Ty(), true) : builder.getInt32(0);
+                Value* operands_v = insertOperandsArray(csl.operands, builder);
+                Value* args[3] = {subloop_num_v, outer_v, operands_v};
+
+                return builder.CreateCall(runindex_fn, args, AsyncDispatch ? "ticket" : "runindex");
+            }
+
+            //register the kernel, its program and its tiling with the runtime on function entry
+            //the kernels are registered and configured once, by a module constructor that runs before
+            //main, so their runtime handles stay resident across calls of the function. Only the range of
+            //a kernel whose range is known at runtime is set again before it is dispatched.
+            void insertPIMRegisterCall(Function* function, CompiledSubLoop& csl) {
+                auto module = function->getParent();
+                auto register_fn = getRuntimeFunction(module, "pim_registerkernel");
+
+                IRBuilder<> builder(getRegistryBlock(module)->getTerminator());
+                Value* program_v = builder.CreateConstInBoundsGEP2_32(csl.program->getValueType(), csl.program, 0, 0);
+                Value* args[3] = {csl.kernel, program_v, builder.getInt32(csl.program_len)};
+
+                Value* handle_v = builder.CreateCall(register_fn, args, "handle");
+                builder.CreateStore(handle_v, getKernelHandle(module, csl));
+
+                auto tile_fn = getRuntimeFunction(module, "pim_tilesubloop");
+                Value* tile_args[3] = {handle_v, builder.getInt32(csl.tile_elements), builder.getInt32(csl.banks)};
+                builder.CreateCall(tile_fn, tile_args, "tile");
+
+                if (csl.range.constant) {
+                    auto init_fn = getRuntimeFunction(module, "pim_initsubloop");
+                    Value* init_args[3] = {handle_v, builder.getInt32(csl.range.start), builder.getInt32(csl.range.end)};
+                    builder.CreateCall(init_fn, init_args, "init");
+                }
+                insertLayoutCalls(function, csl);
+            }
+
+            //sub_loop_handle<N>, the runtime handle pim_registerkernel returned for a kernel. Kernel numbers
+            //are only unique within a module, so several instrumented modules can be linked together.
+            GlobalVariable* getKernelHandle(Module* module, CompiledSubLoop& csl) {
+                std::stringstream ss;
+                ss << "sub_loop_handle" << csl.kernel_num;
+                if (auto handle = module->getGlobalVariable(ss.str(), true)) {
+                    return handle;
+                }
+                auto i32 = Type::getInt32Ty(module->getContext());
+                return new GlobalVariable(*module, i32, false, GlobalValue::InternalLinkage, ConstantInt::get(i32, -1), ss.str());
+            }
+
+            Value* loadKernelHandle(IRBuilder<>& builder, CompiledSubLoop& csl) {
+                auto handle = getKernelHandle(builder.GetInsertBlock()->getModule(), csl);
+                return builder.CreateLoad(builder.getInt32Ty(), handle, "handle");
+            }
+
+            //the handles are only written by the module constructor
+            bool isKernelHandle(Value* pointer) {
+                auto global = dyn_cast<GlobalVariable>(pointer);
+                return global != nullptr && global->getName().startswith("sub_loop_handle");
+            }
+
+            //autopim_register_kernels, the constructor of the module all kernels and profile counters are registered in
+            BasicBlock* getRegistryBlock(Module* module) {
+                if (auto registry = module->getFunction("autopim_register_kernels")) {
+                    return &registry->getEntryBlock();
+                }
+                auto& context = module->getContext();
+                auto registry = Function::Create(FunctionType::get(Type::getVoidTy(context), false), GlobalValue::InternalLinkage,
+                                                 "autopim_register_kernels", module);
+                auto entry = BasicBlock::Create(context, "entry", registry);
+                auto ret = ReturnInst::Create(context, entry);
+                appendToGlobalCtors(*module, registry, 65535);
+
+                //the runtime simulates the target the kernels were compiled for. The pass and the
+                //runtime share pimmodel.h, so the target is handed over as the bytes of its struct.
+                if (custom_target) {
+                    auto bytes = ConstantDataArray::getRaw(StringRef(reinterpret_cast<const char*>(&target), sizeof(target)),
+                                                           sizeof(target), Type::getInt8Ty(context));
+                    auto global = new GlobalVariable(*module, bytes->getType(), true, GlobalValue::PrivateLinkage, bytes, "autopim_target");
+                    global->setAlignment(Align(alignof(pim_target)));
+                    IRBuilder<> builder(ret);
+                    Value* target_v = builder.CreateConstInBoundsGEP2_32(bytes->getType(), global, 0, 0);
+                    builder.CreateCall(getRuntimeFunction(module, "pim_settarget"), {target_v}, "target");
+                }
+                return entry;
+            }
+
+            //pack the arrays the kernel reads in a packed layout on function entry and release
+            //the packed copies before every return. An array is packed once per function.
+            void insertLayoutCalls(Function* function, CompiledSubLoop& csl) {
+                auto pack_fn = getRuntimeFunction(function->getParent(), "pim_pack");
+                auto unpack_fn = getRuntimeFunction(function->getParent(), "pim_unpack");
+
+                for (auto& array_layout : csl.layouts) {
+                    auto key = std::make_tuple(function, array_layout.base, array_layout.layout);
+                    auto iter = packed_arrays.find(key);
+                    if (iter != packed_arrays.end()) {
+                        //widen the existing shadow so it covers this kernel as well
+                        auto pack = iter->second;
+                        for (unsigned int i : {1u, 3u}) {
+                            auto current = cast<ConstantInt>(pack->getArgOperand(i))->getZExtValue();
+                            unsigned int wanted = i == 1 ? array_layout.elements : array_layout.packed_bits;
+                            if (wanted > current) {
+                                pack->setArgOperand(i, ConstantInt::get(pack->getArgOperand(i)->getType(), wanted));
+                            }
+                        }
+                        continue;
+                    }
+
+                    IRBuilder<> builder(&*function->getEntryBlock().getFirstInsertionPt());
+                    Value* base_v = builder.CreateBitCast(array_layout.base, builder.getInt8PtrTy());
+                    Value* args[5] = {base_v, builder.getInt32(array_layout.elements), builder.getInt32(array_layout.element_bits),
+                                      builder.getInt32(array_layout.packed_bits), builder.getInt32(array_layout.layout)};
+                    packed_arrays[key] = builder.CreateCall(pack_fn, args, "pack");
+
+                    for (auto& block : *function) {
+                        if (auto ret = dyn_cast<ReturnInst>(block.getTerminator())) {
+                            IRBuilder<> exit_builder(ret);
+                            exit_builder.CreateCall(unpack_fn, {exit_builder.CreateBitCast(array_layout.base, exit_builder.getInt8PtrTy())}, "unpack");
+                        }
+                    }
+                }
             }
 
-            LoopRange getLoopRange(Loop* loop) {
-                auto header = loop->getHeader();
-                
-                Value* start = nullptr;
-                Value* end = nullptr;
+            //batching moves all of the dispatches of a kernel out of the outer loop, which is only
+            //valid when the sub-loops it replaces are the only thing the outer loop does. Anything else
+            //with side effects in the outer loop would observe the sub-loops running all at once.
+            bool isBatchDispatchValid(Loop* loop, const std::vector<Loop*>& sub_loop_vector, LoopRange& outer_range) {
+                if (sub_loop_vector.size() != loop->getSubLoops().size() || loop->getExitBlock() == nullptr) {
+                    return false;
+                }
+
+                if (!getLoopRange(loop, outer_range)) {
+                    return false;
+                }
+
+                //a single command covers every outer iteration, so they all have to share the sub-loop range
+                auto sub_loop = sub_loop_vector[0];
+                LoopRange range;
+                if (!getLoopRange(sub_loop, range) || !se->isLoopInvariant(range.start_expr, loop) ||
+                    !se->isLoopInvariant(range.end_expr, loop)) {
+                    return false;
+                }
 
-                bool first_phi = true;
-                bool first_icmp = true;
-                
-                PHINode* phi = nullptr;
-                ICmpInst* icmp = nullptr;
- 
                 for (auto block_iter = loop->block_begin(); block_iter != loop->block_end(); ++block_iter) {
+                    if (std::any_of(sub_loop_vector.begin(), sub_loop_vector.end(), [&](Loop* l) { return l->contains(*block_iter); })) {
+                        continue;
+                    }
+
                     for (auto& instruction : **block_iter) {
-                        if ((phi = dyn_cast<PHINode>(&instruction)) && first_phi) {
-                            start = phi->getIncomingValue(0);
-                            first_phi = false;
-                        }
-                        else if ((icmp = dyn_cast<ICmpInst>(&instruction)) && first_icmp) {
-                            end = icmp->getOperand(1);
-                            first_icmp = false;
+                        if (instruction.mayHaveSideEffects()) {
+                            return false;
                         }
                     }
                 }
-                LoopRange range(cast<ConstantInt>(start)->getSExtValue(), cast<ConstantInt>(end)->getSExtValue());
-                return range;
+                return true;
             }
 
-            void compileSubLoop(Loop* sub_loop, int sub_loop_num,  AccessPattern& pattern) {
-                outs() << "[Sub-Loop Processing Report]\n";
-                outs() << "Loop interchange";
+            //replace the per iteration dispatch of a sub-loop with a single command covering the
+            //whole outer range, issued in the exit block of the outer loop and followed by a flush
+            //of the form pim_runrange(subloop_num, outer_start, outer_end, operands); pim_flush()
+            //when dispatching asynchronously the flush is a pim_submit() that returns a ticket.
+            //With a runtime check the calls only run when on_pim holds.
+            Instruction* insertBatchedPIMCalls(Loop* loop, CompiledSubLoop& csl, const LoopRange& outer_range, Value* on_pim,
+                                               LoopInfo& loop_info, DominatorTree& dominator_tree) {
+                auto exit = loop->getExitBlock();
+                auto module = exit->getParent()->getParent();
+                auto init_fn = getRuntimeFunction(module, "pim_initsubloop");
+                auto runrange_fn = getRuntimeFunction(module, "pim_runrange");
+                auto flush_fn = getRuntimeFunction(module, AsyncDispatch ? "pim_submit" : "pim_flush");
 
-                if (isLoopInterchangeValid(sub_loop, sub_loop, pattern)) {
-                    outs() << " is required.\n";
+                Instruction* position = &*exit->getFirstInsertionPt();
+                if (on_pim != nullptr) {
+                    position = SplitBlockAndInsertIfThen(on_pim, position, false, nullptr, &dominator_tree, &loop_info);
                 }
-                else {
-                    outs() << " is not required.\n";
+
+                IRBuilder<> builder(position);
+                Value* handle_v = loadKernelHandle(builder, csl);
+                if (!csl.range.constant) {
+                    Value* init_args[3] = {handle_v, expandBound(csl.range.start_expr, position),
+                                           expandBound(csl.range.end_expr, position)};
+                    builder.CreateCall(init_fn, init_args, "init");
                 }
 
-                outs() << "PIM compile ";
-                Value* value;
-                if (subLoopIsVectorLoop(sub_loop, pattern, &value)) {
-                    outs() << "can be done.\n";        
-                    CompiledSubLoop csl;
-                    csl.sub_loop_index = sub_loop_num;
-                    csl.compiled = true;
-                    csl.range = getLoopRange(sub_loop);
-                    
-                    auto ast = extractComputation(value, pattern);
+                Value* operands_v = insertOperandsArray(csl.operands, builder);
+                Value* runrange_args[4] = {handle_v, expandBound(outer_range.start_expr, position),
+                                           expandBound(outer_range.end_expr, position), operands_v};
+                builder.CreateCall(runrange_fn, runrange_args, "runrange");
+                CallInst* flush = builder.CreateCall(flush_fn, {}, AsyncDispatch ? "ticket" : "flush");
 
-                    std::stringstream ss;
-                    ss << "pim_runindex(sub_loop_fn" << sub_loop_num << ", " << "index);";
-                    outs() << "Compiled: " << ss.str().c_str() << "\n";
-                    outs() << "define sub_loop_fn" << sub_loop_num << " = ";
-                    compileAST(ast);
-                    outs() << "\n";
-                    CostModel cm;
-                    csl.cost = cm.computeCost(ast);
+                insertPIMRegisterCall(exit->getParent(), csl);
+                return on_pim != nullptr ? mergeTicket(flush, exit) : flush;
+            }
 
-                    outs() << "Sub-loop function area cost (approx.): " << csl.cost << "\n";
+            //a kernel is dispatched behind a runtime check when its range is only known at runtime or
+            //alias analysis could not keep its arrays apart, the loop is then kept as the host version
+            bool isGuarded(const CompiledSubLoop& csl) {
+                return !csl.range.constant || !csl.alias_checks.empty();
+            }
 
-                    csl.compiled_expr = ss.str();
+            //the checks of a guarded dispatch: the trip count of a range only known at runtime has to
+            //reach the break-even point of its kernel, and the arrays that may alias must not overlap
+            //over the part of the nest the dispatch covers. The result picks between the PIM dispatch
+            //and the host loop.
+            Value* insertRuntimeCheck(CompiledSubLoop& csl, Instruction* position) {
+                IRBuilder<> builder(position);
+                Value* on_pim = nullptr;
+                auto require = [&](Value* condition) {
+                    on_pim = on_pim != nullptr ? builder.CreateAnd(on_pim, condition) : condition;
+                };
+                if (!csl.range.constant) {
+                    auto trip_count = expandBound(se->getMinusSCEV(csl.range.end_expr, csl.range.start_expr), position);
+                    require(builder.CreateICmpSGE(trip_count, builder.getInt32(csl.min_trip)));
+                }
 
-                    sub_loops[sub_loop_num] = csl;
+                SCEVExpander expander(*se, position->getModule()->getDataLayout(), "pim.extent");
+                auto expandExtent = [&](Instruction* access, Value*& low, Value*& high) {
+                    const SCEV* low_expr;
+                    const SCEV* high_expr;
+                    getAccessExtent(access, position, low_expr, high_expr);
+                    low = builder.CreatePtrToInt(expander.expandCodeFor(low_expr, low_expr->getType(), position), builder.getInt64Ty());
+                    high = builder.CreatePtrToInt(expander.expandCodeFor(high_expr, high_expr->getType(), position), builder.getInt64Ty());
+                };
+                for (auto& check : csl.alias_checks) {
+                    Value* first_low;
+                    Value* first_high;
+                    Value* second_low;
+                    Value* second_high;
+                    expandExtent(check.first, first_low, first_high);
+                    expandExtent(check.second, second_low, second_high);
+                    require(builder.CreateOr(builder.CreateICmpULE(first_high, second_low), builder.CreateICmpULE(second_high, first_low)));
                 }
-                else {
-                    CompiledSubLoop csl;
-                    csl.compiled = false;
-                    sub_loops[sub_loop_num] = csl;
-                    outs() << " cannot be done.\n";
+
+                if (RowAlignCheck && !csl.alias_checks.empty()) {
+                    for (auto operand : csl.operands) {
+                        if (operand->getType()->isPointerTy()) {
+                            auto offset = builder.CreateAnd(builder.CreatePtrToInt(operand, builder.getInt64Ty()), target.row_bytes - 1);
+                            require(builder.CreateICmpEQ(offset, builder.getInt64(0)));
+                        }
+                    }
                 }
+                on_pim->setName("on_pim");
+                return on_pim;
             }
 
-            //check if an instruction is a memeber of a certain basic block
-            bool isInstructionInBasicBlock(Instruction* instr, BasicBlock* bb) {
-                for (auto& instruction : *bb) {
-                    if (instr == &instruction) {
-                        return true;
-                    }
+            //a guarded dispatch leaves no ticket behind when the host ran the loop, it then
+            //waits on ticket 0 which the runtime ignores
+            Instruction* mergeTicket(CallInst* ticket, BasicBlock* skipped) {
+                if (!AsyncDispatch) {
+                    return ticket;
                 }
-                return false;
+                auto dispatch_block = ticket->getParent();
+                auto tail = dispatch_block->getSingleSuccessor();
+                auto phi = PHINode::Create(ticket->getType(), 2, "ticket", &tail->front());
+                phi->addIncoming(ticket, dispatch_block);
+                phi->addIncoming(ConstantInt::get(ticket->getType(), 0), skipped);
+                return phi;
             }
 
-            //erase is valid as long as there isn't something in the loop that is from
-            //outside the loop, minus the array accesses
-            bool isEraseSubLoopValid(Loop* loop, DominatorTree& DT) {
-                auto header = loop->getHeader();
-                auto exit = loop->getExitBlock();
+            //dispatch a guarded sub-loop from its preheader, behind the runtime check. The loop itself
+            //stays as the host path and is skipped when on_pim holds, and so are the sub-loops fused
+            //into its kernel.
+            Instruction* insertGuardedPIMCall(Loop* sub_loop, CompiledSubLoop& csl, Value* outer_iv,
+                                              LoopInfo& loop_info, DominatorTree& dominator_tree) {
+                auto preheader = sub_loop->getLoopPreheader();
+                auto module = preheader->getModule();
+                auto init_fn = getRuntimeFunction(module, "pim_initsubloop");
+                auto runindex_fn = getRuntimeFunction(module, AsyncDispatch ? "pim_launch" : "pim_runindex");
 
-                BasicBlock* block = nullptr;
-                for (auto succ_iter = succ_begin(header); succ_iter != succ_end(header); ++succ_iter) {
-                    if (*succ_iter != exit) {
-                        block = *succ_iter;
-                        break;
+                auto on_pim = insertRuntimeCheck(csl, preheader->getTerminator());
+                auto position = SplitBlockAndInsertIfThen(on_pim, preheader->getTerminator(), false, nullptr,
+                                                          &dominator_tree, &loop_info);
+
+                if (!csl.range.constant) {
+                    //a range invariant in the enclosing loop is set once in its preheader instead of per dispatch
+                    auto init_position = position;
+                    auto parent = sub_loop->getParentLoop();
+                    if (parent && parent->getLoopPreheader() && se->isLoopInvariant(csl.range.start_expr, parent) &&
+                        se->isLoopInvariant(csl.range.end_expr, parent)) {
+                        init_position = parent->getLoopPreheader()->getTerminator();
                     }
+                    IRBuilder<> init_builder(init_position);
+                    Value* init_args[3] = {loadKernelHandle(init_builder, csl), expandBound(csl.range.start_expr, init_position),
+                                           expandBound(csl.range.end_expr, init_position)};
+                    init_builder.CreateCall(init_fn, init_args, "init");
                 }
 
-                BasicBlockEdge bbe(loop->getHeader(), block);
+                IRBuilder<> builder(position);
+                Value* outer_v = outer_iv ? builder.CreateIntCast(outer_iv, builder.getInt32Ty(), true) : builder.getInt32(0);
+                Value* args[3] = {loadKernelHandle(builder, csl), outer_v, insertOperandsArray(csl.operands, builder)};
+                auto ticket = builder.CreateCall(runindex_fn, args, AsyncDispatch ? "ticket" : "runindex");
 
-                for (auto& instr : *block) {
-                    for (int i = 0; i < instr.getNumOperands(); i++) {
-                        auto& u = instr.getOperandUse(i);
-                        if (isa<GetElementPtrInst>(instr) || isa<StoreInst>(instr) || isa<LoadInst>(instr)) {
-                            continue;
+                for (auto member : csl.loops) {
+                    guardSubLoop(member, on_pim);
+                }
+                return mergeTicket(ticket, preheader);
+            }
+
+            //the loops walk whole arrays, so the two pointers are compared over everything reachable from them
+            bool mayShareMemory(Value* a, Value* b) {
+                return aa->alias(MemoryLocation::getBeforeOrAfter(a), MemoryLocation::getBeforeOrAfter(b)) != AliasResult::NoAlias;
+            }
+
+            //does the host instruction read what the kernel writes, or write anything it uses
+            bool conflictsWithKernel(Instruction* instruction, CompiledSubLoop& csl) {
+                if (!instruction->mayReadOrWriteMemory()) {
+                    return false;
+                }
+
+                if (auto call = dyn_cast<CallBase>(instruction)) {
+                    //the PIM unit executes commands in the order they are issued
+                    return !isPIMCall(call);
+                }
+                else if (auto load = dyn_cast<LoadInst>(instruction)) {
+                    if (isKernelHandle(load->getPointerOperand())) {
+                        return false;
+                    }
+                    for (auto& part : csl.stores) {
+                        if (mayShareMemory(load->getPointerOperand(), part.store->getPointerOperand())) {
+                            return true;
                         }
-                        
-                        if (!DT.dominates(bbe, u)) {
-                            return false;
+                    }
+                    return false;
+                }
+                else if (auto store = dyn_cast<StoreInst>(instruction)) {
+                    for (auto operand : csl.operands) {
+                        if (operand->getType()->isPointerTy() && mayShareMemory(store->getPointerOperand(), operand)) {
+                            return true;
                         }
                     }
+                    return false;
                 }
-                
                 return true;
             }
-    
-            //insert PIM calls in the subloop header to trigger pim computations
-            //of the form pim_runindex(subloop_num, num)
-            void insertSubLoopPIMCall(Loop* sub_loop, int sub_loop_num, Value* outer_iv) {
-                auto header = sub_loop->getHeader();
-                Function* runindex_fn = header->getParent()->getParent()->getFunction("pim_runindex");
-                if (!runindex_fn) {
-                    outs() << "[Error] Could not load subloop PIM runtime function.\n";
-                }
-                
-                Value *subloop_num_v = ConstantInt::getSigned(IntegerType::get(runindex_fn->getContext(), 32), sub_loop_num);
-                Value* args[2] = {subloop_num_v, outer_iv};
-                
-                FunctionType* ft = cast<FunctionType>(cast<PointerType>(runindex_fn->getType())->getElementType());
 
-                if (!ft) {
-                    outs() << "[Error] could not get function type.\n";
-                    return;
-                }
-                
-                CallInst::Create(ft, runindex_fn, args, "runindex", header->getFirstNonPHI());
-            }
+            //place pim_wait(ticket) right before the first host instruction after the launch that
+            //conflicts with the kernel. The scan follows unique successors that the launch dominates
+            //so the wait is on every path out of it, and stops before entering a loop that is still
+            //there so the wait does not end up running on every iteration of it.
+            void insertPIMWait(Instruction* ticket, CompiledSubLoop& csl, LoopInfo& loop_info, DominatorTree& dominator_tree) {
+                auto wait_fn = getRuntimeFunction(ticket->getModule(), "pim_wait");
+                auto launch_block = ticket->getParent();
+                auto block = launch_block;
+                Instruction* position = isa<PHINode>(ticket) ? launch_block->getFirstNonPHI() : ticket->getNextNode();
 
-            //insert pim_initsubloop call
-            void insertPIMInitCall(Loop* loop, int subloop_num, int range_start, int range_end) {
-                auto header = loop->getHeader();
-                Function* init_fn = header->getParent()->getParent()->getFunction("pim_initsubloop");
-                if (!init_fn) {
-                    outs() << "[Error] Could not load loop PIM runtime function.\n";
-                }
+                while (true) {
+                    for (; position != block->getTerminator(); position = position->getNextNode()) {
+                        if (conflictsWithKernel(position, csl)) {
+                            CallInst::Create(wait_fn, {ticket}, "", position);
+                            return;
+                        }
+                    }
 
-                FunctionType* ft = cast<FunctionType>(cast<PointerType>(init_fn->getType())->getElementType());
+                    auto next = block->getUniqueSuccessor();
+                    if (next == nullptr || conflictsWithKernel(block->getTerminator(), csl) ||
+                        !dominator_tree.dominates(launch_block, next) ||
+                        (loop_info.isLoopHeader(next) && erased_headers.count(next) == 0)) {
+                        break;
+                    }
 
-                if (!ft) {
-                    outs() << "[Error] could not get function type.\n";
-                    return;
+                    block = next;
+                    position = block->getFirstNonPHI();
                 }
 
-                auto& context =  init_fn->getContext();
-
-                Value *subloop_num_v = ConstantInt::getSigned(IntegerType::get(context, 32), subloop_num); 
-                Value *range_start_v = ConstantInt::getSigned(IntegerType::get(context, 32), range_start); 
-                Value *range_end_v = ConstantInt::getSigned(IntegerType::get(context, 32), range_end); 
-                Value* args[3] = {subloop_num_v, range_start_v, range_end_v};
-                
-                CallInst::Create(ft, init_fn, args, "init", header->getFirstNonPHI());
+                CallInst::Create(wait_fn, {ticket}, "", block->getTerminator());
             }
-                
-            //insert PIM calls in the loop header to init the process
-            //of the form pim_initsubloop(subloop_num, range_start, range_end)                
+
+            //register the compiled sub-loops with the module constructor, which also sets their range
+            //when it is constant. Guarded sub-loops set a runtime range right before they are dispatched
             void insertLoopPIMCalls(Loop* loop, int sub_loop_num_max) {
                 for (int i = 0; i < sub_loop_num_max; i++) {
                     if (sub_loops[i].compiled) {
-                        insertPIMInitCall(loop, i, sub_loops[i].range.start, sub_loops[i].range.end);
+                        insertPIMRegisterCall(loop->getHeader()->getParent(), sub_loops[i]);
                     }
                 }
             }
@@ -599,7 +3585,7 @@ namespace {
                 auto exit = sub_loop->getExitBlock();
             
                 if (!exit) {
-                    outs() << "Error while removing sub-loop: exit block not found.\n";
+                    report() << "Error while removing sub-loop: exit block not found.\n";
                     return;
                 }
                
@@ -607,98 +3593,611 @@ namespace {
                     if (auto br = dyn_cast<BranchInst>(&instruction)) {
                         br->setSuccessor(0, exit);
                         br->setSuccessor(1, exit);
-                        outs() << "Branch modified successfully, sub-loop is now dead and will be removed.\n";
+                        erased_headers.insert(header);
+                        report() << "Branch modified successfully, sub-loop is now dead and will be removed.\n";
+                    }
+                }
+            }
+
+            //keep the sub-loop as the host path of a guarded dispatch: its header leaves the loop
+            //right away when on_pim holds, the loop still runs when the check fails
+            void guardSubLoop(Loop* sub_loop, Value* on_pim) {
+                auto br = cast<BranchInst>(sub_loop->getHeader()->getTerminator());
+                IRBuilder<> builder(br);
+                if (sub_loop->contains(br->getSuccessor(0))) {
+                    br->setCondition(builder.CreateAnd(br->getCondition(), builder.CreateNot(on_pim)));
+                }
+                else {
+                    br->setCondition(builder.CreateOr(br->getCondition(), on_pim));
+                }
+                se->forgetLoop(sub_loop);
+                report() << "Branch guarded by the runtime check, sub-loop is kept as the host version.\n";
+            }
+
+            //a loop the analysis proved independent that is not offloaded still runs on all host cores: it
+            //is cloned into host_loop_fn<N>(range_start, range_end, operands), which runs one chunk of its
+            //range and is marked for the vectorizer, and replaced by pim_hostrange which hands out the chunks
+            bool insertHostFallback(Loop* body_loop, AccessPattern pattern) {
+                std::vector<StoreInst*> stores;
+                std::vector<KernelStore> parts;
+                LoopRange range;
+                auto preheader = body_loop->getLoopPreheader();
+                auto exit = body_loop->getExitBlock();
+                if (!HostFallback || planning || preheader == nullptr || exit == nullptr || !subLoopIsVectorLoop(body_loop, pattern, stores) ||
+                    !areStoresIndependent(body_loop, stores, parts, nullptr) || !getLoopRange(body_loop, range)) {
+                    return false;
+                }
+
+                //the iterations may only communicate through the arrays they store to, and the header
+                //still runs once after the loop is erased
+                auto induction_variable = getIndexVariable(body_loop);
+                std::vector<Value*> operands;
+                for (auto block : body_loop->blocks()) {
+                    for (auto& instruction : *block) {
+                        if ((instruction.mayHaveSideEffects() && (!isa<StoreInst>(instruction) || block == body_loop->getHeader())) ||
+                            (isa<PHINode>(instruction) && block == body_loop->getHeader() && &instruction != induction_variable)) {
+                            return false;
+                        }
+                        for (auto user : instruction.users()) {
+                            if (!body_loop->contains(cast<Instruction>(user))) {
+                                return false;
+                            }
+                        }
+                        for (auto& operand : instruction.operands()) {
+                            auto definition = dyn_cast<Instruction>(operand);
+                            if ((isa<Argument>(operand) || (definition != nullptr && !body_loop->contains(definition))) &&
+                                std::find(operands.begin(), operands.end(), operand) == operands.end()) {
+                                if (!operand->getType()->isPointerTy() && !operand->getType()->isIntegerTy()) {
+                                    return false;
+                                }
+                                operands.push_back(operand);
+                            }
+                        }
                     }
                 }
+
+                auto module = preheader->getModule();
+                auto& context = module->getContext();
+                auto operands_type = Type::getInt8PtrTy(context)->getPointerTo();
+                auto ft = FunctionType::get(Type::getVoidTy(context), {Type::getInt64Ty(context), Type::getInt64Ty(context), operands_type}, false);
+
+                std::stringstream ss;
+                ss << "host_loop_fn" << host_loop_count++;
+                auto host_fn = Function::Create(ft, GlobalValue::InternalLinkage, ss.str(), module);
+                host_fn->addFnAttr("autopim-host-loop");
+                auto entry = BasicBlock::Create(context, "entry", host_fn);
+                IRBuilder<> builder(entry);
+
+                ValueToValueMapTy value_map;
+                auto i8ptr = builder.getInt8PtrTy();
+                for (unsigned int i = 0; i < operands.size(); i++) {
+                    auto slot = builder.CreateConstInBoundsGEP1_32(i8ptr, host_fn->getArg(2), i);
+                    Value* operand = builder.CreateLoad(i8ptr, slot);
+                    auto type = operands[i]->getType();
+                    value_map[operands[i]] = type->isPointerTy() ? builder.CreateBitCast(operand, type) : builder.CreatePtrToInt(operand, type);
+                }
+
+                auto ret = BasicBlock::Create(context, "exit", host_fn);
+                ReturnInst::Create(context, ret);
+                value_map[preheader] = entry;
+                value_map[exit] = ret;
+                SmallVector<BasicBlock*, 8> blocks;
+                for (auto block : body_loop->blocks()) {
+                    auto clone = CloneBasicBlock(block, value_map, ".host", host_fn);
+                    value_map[block] = clone;
+                    blocks.push_back(clone);
+                }
+                remapInstructionsInBlocks(blocks, value_map);
+                builder.CreateBr(cast<BasicBlock>(value_map[body_loop->getHeader()]));
+
+                //the clone runs [range_start, range_end) instead of the whole range
+                auto phi = cast<PHINode>(value_map[induction_variable]);
+                builder.SetInsertPoint(entry->getTerminator());
+                phi->setIncomingValueForBlock(entry, builder.CreateIntCast(host_fn->getArg(0), phi->getType(), true));
+                auto br = cast<BranchInst>(cast<BasicBlock>(value_map[body_loop->getHeader()])->getTerminator());
+                builder.SetInsertPoint(br);
+                auto end = builder.CreateIntCast(host_fn->getArg(1), phi->getType(), true);
+                br->setCondition(body_loop->contains(body_loop->getHeader()->getTerminator()->getSuccessor(0)) ?
+                                 builder.CreateICmpSLT(phi, end) : builder.CreateICmpSGE(phi, end));
+
+                //vectorize at the widest element the loop stores that fits a vector register
+                unsigned int element_bits = 8;
+                for (auto store : stores) {
+                    element_bits = std::max(element_bits, getBitWidth(store->getValueOperand()->getType()));
+                }
+                unsigned int width = std::max((unsigned int)tti->getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedSize() / element_bits, 1u);
+                auto latch_br = cast<Instruction>(value_map[body_loop->getLoopLatch()->getTerminator()]);
+                auto loop_id = MDNode::getDistinct(context, {nullptr,
+                    MDNode::get(context, {MDString::get(context, "llvm.loop.vectorize.enable"), ConstantAsMetadata::get(builder.getTrue())}),
+                    MDNode::get(context, {MDString::get(context, "llvm.loop.vectorize.width"), ConstantAsMetadata::get(builder.getInt32(width))})});
+                loop_id->replaceOperandWith(0, loop_id);
+                latch_br->setMetadata(LLVMContext::MD_loop, loop_id);
+
+                auto position = preheader->getTerminator();
+                builder.SetInsertPoint(position);
+                Value* args[4] = {host_fn, expandBound(range.start_expr, position), expandBound(range.end_expr, position),
+                                  insertOperandsArray(operands, builder)};
+                builder.CreateCall(getRuntimeFunction(module, "pim_hostrange"), args, "hostrange");
+
+                report() << "[Host Fallback] " << host_fn->getName() << " runs the loop in parallel on the host, vectorize width " << width << ".\n";
+                emitRemark([&]() {
+                    return OptimizationRemark(DEBUG_TYPE, "HostFallback", body_loop->getStartLoc(), body_loop->getHeader())
+                           << "runs in parallel on the host as " << ore::NV("Function", host_fn->getName())
+                           << ", vectorize width " << ore::NV("VectorizeWidth", width);
+                });
+                eraseSubLoop(body_loop);
+                return true;
             }
 
 
-            virtual bool runOnLoop(Loop* loop, LPPassManager& LPM) {
-                LoopInfo& loop_info = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
-                ScalarEvolution& scalar_evolution = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
-                auto& dominator_tree = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-                int single_loop_count = 447;
+            //transform one loop nest: compile its sub-loops, or the loop itself when it has none, and
+            //replace them with calls into the PIM runtime. A nest deeper than two levels keeps its
+            //outer loops on the host, host_idx holds their induction variables, outermost first.
+            bool runOnLoop(Loop* loop, const std::vector<Value*>& host_idx, LoopInfo& loop_info, ScalarEvolution& scalar_evolution,
+                           DominatorTree& dominator_tree) {
                 int total_cost = 0;
+                const auto sub_loop_vector = loop->getSubLoops();
+                if (std::any_of(sub_loop_vector.begin(), sub_loop_vector.end(), [](Loop* l) { return !l->getSubLoops().empty(); })) {
+                    auto induction_variable = getIndexVariable(loop);
+                    if (induction_variable == nullptr) {
+                        return false;
+                    }
+                    report() << "\n[Loop Nest Report] depth " << loop->getLoopDepth() << " loop stays on the host, dispatching its sub-loops.\n";
+                    emitRemark([&]() {
+                        return OptimizationRemarkAnalysis(DEBUG_TYPE, "LoopNest", loop->getStartLoc(), loop->getHeader())
+                               << "depth " << ore::NV("Depth", loop->getLoopDepth()) << " loop stays on the host, dispatching its sub-loops";
+                    });
+                    std::vector<Value*> inner_host_idx = host_idx;
+                    inner_host_idx.push_back(induction_variable);
+                    bool changed = false;
+                    for (auto sub_loop : sub_loop_vector) {
+                        changed |= runOnLoop(sub_loop, inner_host_idx, loop_info, scalar_evolution, dominator_tree);
+                    }
+                    return changed;
+                }
 
-                //run analysis only on outermost loops
-                if (loop->getLoopDepth() == 1) {
-                    outs() << "\n[Loop Processing Report] found compatible outer loop. Checking subloops...\n";
-                    AccessPattern pattern;
-                    pattern.first_idx = loop->getCanonicalInductionVariable();
-                    
-                    const auto& sub_loop_vector = loop->getSubLoops();
-                    int i = 0;
-                    
-                    if (sub_loop_vector.size() == 0) {
-                        outs() << "Found no subloops. Attempting to process main loop itself...\n";
-                        Value* value;
-                        if (subLoopIsVectorLoop(loop, pattern, &value)) {
-                            outs() << "can be done.\n";        
-                            LoopRange range = getLoopRange(loop);
-                            int sub_loop_num = single_loop_count++;
-                            auto ast = extractComputation(value, pattern);
-
-                            std::stringstream ss;
-                            ss << "pim_runindex(sub_loop_fn" << sub_loop_num << ", " << "index);";
-                            outs() << "Compiled: " << ss.str().c_str() << "\n";
-                            outs() << "define sub_loop_fn" << sub_loop_num << " = ";
-                            compileAST(ast);
-                            outs() << "\n";
-                            CostModel cm;
-                            int cost = cm.computeCost(ast);
-                            total_cost += cost;
-                            outs() << "Loop function area cost (approx.): " << cost << "\n";
-    
-                            insertSubLoopPIMCall(loop, sub_loop_num, pattern.first_idx);
-                            insertPIMInitCall(loop, sub_loop_num, range.start, range.end);
-                            
-                            if (isEraseSubLoopValid(loop, dominator_tree)) {
-                                outs() << "Loop can be erased.\n";
+                report() << "\n[Loop Processing Report] found compatible outer loop. Checking subloops...\n";
+                AccessPattern pattern;
+                pattern.first_idx = getIndexVariable(loop);
+                pattern.host_idx = host_idx;
+                
+                int i = 0;
+                
+                if (sub_loop_vector.size() == 0) {
+                    report() << "Found no subloops. Attempting to process main loop itself...\n";
+                    CompiledSubLoop csl;
+                    if (compileLoopBody(loop, loop, pattern, csl, scalar_evolution)) {
+                        printCost("Loop", csl);
+                        if (!csl.compiled || !isWithinAreaBudget(loop, csl)) {
+                            return insertHostFallback(loop, pattern);
+                        }
+                        total_cost += csl.cost;
+
+                        if (isEraseSubLoopValid(loop, dominator_tree)) {
+                            report() << "Loop can be erased.\n";
+                            Instruction* ticket = nullptr;
+                            if (!isGuarded(csl)) {
+                                ticket = insertSubLoopPIMCall(loop, csl, pattern.first_idx);
+                                insertPIMRegisterCall(loop->getHeader()->getParent(), csl);
                                 eraseSubLoop(loop);
                             }
                             else {
-                                outs() << "Loop cannot be erased.\n";
+                                //the loop is its own outer loop, the kernel only uses the inner index
+                                ticket = insertGuardedPIMCall(loop, csl, nullptr, loop_info, dominator_tree);
+                                insertPIMRegisterCall(loop->getHeader()->getParent(), csl);
                             }
-                            return true;
+                            if (AsyncDispatch) {
+                                insertPIMWait(ticket, csl, loop_info, dominator_tree);
+                            }
+                            remarkOffloaded(csl, "single");
                         }
                         else {
-                            outs() << " cannot be done.\n";
-                            return false; 
+                            report() << "Loop cannot be erased.\n";
+                            remarkMissed(loop, "NotErasable", "the loop body uses values the dispatch cannot replace");
                         }
+                        return true;
                     }
-                        
-                    for (auto sub_loop : sub_loop_vector) {
-                       compileSubLoop(sub_loop, i++, pattern); 
+                    else {
+                        report() << " cannot be done.\n";
+                        return insertHostFallback(loop, pattern);
+                    }
+                }
+                    
+                for (auto sub_loop : sub_loop_vector) {
+                   compileSubLoop(loop, sub_loop, i++, pattern, scalar_evolution); 
+                }
+                fuseSubLoops(loop, i);
+                for (int idx = 0; idx < i; idx++) {
+                    if (sub_loops[idx].compiled && !isWithinAreaBudget(loop, sub_loops[idx])) {
+                        //the sub-loops fused into the kernel are left on the host with it
+                        for (int member = idx + 1; member < i; member++) {
+                            auto& members = sub_loops[idx].loops;
+                            if (sub_loops[member].fused && std::find(members.begin(), members.end(), sub_loop_vector[member]) != members.end()) {
+                                sub_loops[member].fused = false;
+                            }
+                        }
+                    }
+                }
+                if (planning) {
+                    return false;
+                }
+
+                LoopRange outer_range;
+                if (BatchDispatch && sub_loops[0].compiled && isBatchDispatchValid(loop, sub_loops[0].loops, outer_range) &&
+                    isEraseKernelValid(sub_loops[0], dominator_tree)) {
+                    report() << "Sub-loop can be erased.\n";
+                    report() << "Batched dispatch: pim_runrange(sub_loop_fn" << sub_loops[0].kernel_num << ", "
+                           << *outer_range.start_expr << ", " << *outer_range.end_expr << ")\n";
+                    total_cost += sub_loops[0].cost;
+                    Instruction* ticket = nullptr;
+                    if (!isGuarded(sub_loops[0])) {
+                        ticket = insertBatchedPIMCalls(loop, sub_loops[0], outer_range, nullptr, loop_info, dominator_tree);
+                        for (auto member : sub_loops[0].loops) {
+                            eraseSubLoop(member);
+                        }
+                    }
+                    else {
+                        //the inner range is invariant in the outer loop, so it is checked once up front,
+                        //together with the arrays over the whole outer range
+                        auto on_pim = insertRuntimeCheck(sub_loops[0], loop->getLoopPreheader()->getTerminator());
+                        for (auto member : sub_loops[0].loops) {
+                            guardSubLoop(member, on_pim);
+                        }
+                        ticket = insertBatchedPIMCalls(loop, sub_loops[0], outer_range, on_pim, loop_info, dominator_tree);
+                    }
+                    if (AsyncDispatch) {
+                        insertPIMWait(ticket, sub_loops[0], loop_info, dominator_tree);
                     }
+                    remarkOffloaded(sub_loops[0], "batched");
+                    return true;
+                }
 
-                    //remove the subloops that were compiled and replace them with
-                    //stub functions that invoke PIM stuff
-                    for (int idx = 0; idx < i; idx++) {
-                        if (sub_loops[idx].compiled) {
-                            if (isEraseSubLoopValid(sub_loop_vector[idx], dominator_tree)) {
-                                outs() << "Sub-loop can be erased.\n";
-                                insertSubLoopPIMCall(sub_loop_vector[idx], idx, pattern.first_idx);
-                                eraseSubLoop(sub_loop_vector[idx]);
+                //remove the subloops that were compiled and replace them with
+                //stub functions that invoke PIM stuff
+                std::vector<std::pair<Instruction*, int>> tickets;
+                for (int idx = 0; idx < i; idx++) {
+                    if (sub_loops[idx].compiled) {
+                        total_cost += sub_loops[idx].cost;
+                        if (isEraseKernelValid(sub_loops[idx], dominator_tree)) {
+                            report() << "Sub-loop can be erased.\n";
+                            if (!isGuarded(sub_loops[idx])) {
+                                tickets.push_back(std::make_pair(insertSubLoopPIMCall(sub_loop_vector[idx], sub_loops[idx], pattern.first_idx), idx));
+                                for (auto member : sub_loops[idx].loops) {
+                                    eraseSubLoop(member);
+                                }
                             }
                             else {
-                                outs() << "Sub-loop cannot be erased.\n";
+                                tickets.push_back(std::make_pair(insertGuardedPIMCall(sub_loop_vector[idx], sub_loops[idx], pattern.first_idx,
+                                                                                      loop_info, dominator_tree), idx));
                             }
+                            remarkOffloaded(sub_loops[idx], "per-iteration");
+                        }
+                        else {
+                            report() << "Sub-loop cannot be erased.\n";
+                            remarkMissed(sub_loops[idx].loops[0], "NotErasable", "the loop body uses values the dispatch cannot replace");
                         }
                     }
-            
-                    insertLoopPIMCalls(loop, i);
                 }
+        
+                insertLoopPIMCalls(loop, i);
+                for (int idx = 0; idx < i; idx++) {
+                    if (!sub_loops[idx].compiled && !sub_loops[idx].fused) {
+                        insertHostFallback(sub_loop_vector[idx], pattern);
+                    }
+                }
+
+                //waits are placed once all sub-loops are erased, so a sub-loop can
+                //overlap with the PIM calls that replaced the ones after it
+                if (AsyncDispatch) {
+                    for (auto& ticket : tickets) {
+                        insertPIMWait(ticket.first, sub_loops[ticket.second], loop_info, dominator_tree);
+                    }
+                }
+                return true;
+            }
+
+            //name a profile counter in the module constructor, returns the internal global autopim_profile<N>
+            //its runtime handle is kept in. Like kernels, counters are only numbered within the module.
+            GlobalVariable* insertProfileRegisterCall(Module* module, const std::string& name) {
+                IRBuilder<> builder(getRegistryBlock(module)->getTerminator());
+                auto i32 = builder.getInt32Ty();
+                auto handle = new GlobalVariable(*module, i32, false, GlobalValue::InternalLinkage, ConstantInt::get(i32, -1),
+                                                 "autopim_profile" + std::to_string(profile_count++));
+                Value* name_v = builder.CreateGlobalStringPtr(name, "autopim.profile");
+                builder.CreateStore(builder.CreateCall(getRuntimeFunction(module, "pim_profileloop"), {name_v}, "profile"), handle);
+                return handle;
+            }
+
+            //count the calls of a loop nest and the time spent in it, and the entries and iterations of its
+            //innermost loops, for a later build with -autopim-profile. The trip count of an innermost loop is
+            //added once on entry, so the loops themselves run unchanged. Innermost loops are named after the
+            //nest and their position in it, loops whose trip count SCEV cannot tell are not counted.
+            bool instrumentLoopNest(Loop* loop, const std::string& name) {
+                auto preheader = loop->getLoopPreheader();
+                if (preheader == nullptr || !loop->hasDedicatedExits()) {
+                    return false;
+                }
+
+                auto module = preheader->getModule();
+                auto nest_handle = insertProfileRegisterCall(module, name);
+                IRBuilder<> builder(preheader->getTerminator());
+                builder.CreateCall(getRuntimeFunction(module, "pim_profileenter"), {builder.CreateLoad(builder.getInt32Ty(), nest_handle, "profile")});
+                SmallVector<BasicBlock*, 4> exits;
+                loop->getUniqueExitBlocks(exits);
+                for (auto exit : exits) {
+                    IRBuilder<> exit_builder(&*exit->getFirstInsertionPt());
+                    exit_builder.CreateCall(getRuntimeFunction(module, "pim_profileexit"),
+                                            {exit_builder.CreateLoad(exit_builder.getInt32Ty(), nest_handle, "profile")});
+                }
+
+                unsigned int innermost = 0;
+                unsigned int counted = 0;
+                auto i64 = builder.getInt64Ty();
+                for (auto sub_loop : loop->getLoopsInPreorder()) {
+                    if (!sub_loop->isInnermost()) {
+                        continue;
+                    }
+                    auto counter_name = name + "." + std::to_string(innermost++);
+                    auto sub_preheader = sub_loop->getLoopPreheader();
+                    auto backedges = se->getBackedgeTakenCount(sub_loop);
+                    if (sub_preheader == nullptr || isa<SCEVCouldNotCompute>(backedges) ||
+                        !isSafeToExpandAt(backedges, sub_preheader->getTerminator(), *se)) {
+                        continue;
+                    }
+
+                    //a loop that exits from its header runs its body once per backedge, like getLoopRange assumes
+                    auto trip = se->getTruncateOrZeroExtend(backedges, i64);
+                    if (sub_loop->getExitingBlock() != sub_loop->getHeader()) {
+                        trip = se->getAddExpr(trip, se->getOne(i64));
+                    }
+                    SCEVExpander expander(*se, module->getDataLayout(), "pim.trip");
+                    auto trip_v = expander.expandCodeFor(trip, i64, sub_preheader->getTerminator());
+                    IRBuilder<> sub_builder(sub_preheader->getTerminator());
+                    auto counter_handle = insertProfileRegisterCall(module, counter_name);
+                    Value* args[2] = {sub_builder.CreateLoad(sub_builder.getInt32Ty(), counter_handle, "profile"), trip_v};
+                    sub_builder.CreateCall(getRuntimeFunction(module, "pim_profileiterations"), args);
+                    counted++;
+                }
+
+                report() << "\n[Loop Profile Report] instrumented loop nest " << name << ", counting the iterations of "
+                       << counted << " of its " << innermost << " innermost loop(s).\n";
+                return true;
+            }
+
+            //the profile has a line per counter: name, entries, iterations and nanoseconds. Loop nests
+            //are ranked by the time spent in them, over all of the nests in the profile.
+            bool loadProfile() {
+                auto buffer = MemoryBuffer::getFile(ProfileFile);
+                if (!buffer) {
+                    report() << "Error while reading the profile " << ProfileFile << ": " << buffer.getError().message() << "\n";
+                    return false;
+                }
+
+                SmallVector<StringRef, 16> lines;
+                (*buffer)->getBuffer().split(lines, '\n', -1, false);
+                std::vector<std::pair<double, std::string>> nests;
+                for (auto line : lines) {
+                    line = line.trim();
+                    if (line.empty() || line.startswith("#")) {
+                        continue;
+                    }
+                    SmallVector<StringRef, 4> fields;
+                    line.split(fields, ' ', -1, false);
+                    LoopProfile counter;
+                    if (fields.size() != 4 || fields[1].getAsInteger(10, counter.entries) || fields[2].getAsInteger(10, counter.iterations) ||
+                        fields[3].getAsDouble(counter.nanoseconds)) {
+                        report() << "Error while reading the profile " << ProfileFile << ": malformed line \"" << line << "\"\n";
+                        profile.clear();
+                        return false;
+                    }
+                    profile[fields[0].str()] = counter;
+
+                    //innermost loops are named <nest>.<position>, the function name may contain dots itself
+                    if (fields[0].find('.', fields[0].rfind(':')) == StringRef::npos) {
+                        profile_nanoseconds += counter.nanoseconds;
+                        nests.push_back(std::make_pair(counter.nanoseconds, fields[0].str()));
+                    }
+                }
+
+                std::sort(nests.rbegin(), nests.rend());
+                report() << "[Profile Report] " << ProfileFile << ": " << nests.size() << " loop nest(s), hottest first\n";
+                for (auto& nest : nests) {
+                    double share = profile_nanoseconds > 0 ? nest.first / profile_nanoseconds : 0;
+                    report() << nest.second << ": " << format("%.1f%%", share * 100) << " of the time over "
+                           << profile[nest.second].entries << " call(s)\n";
+                }
+                return true;
+            }
+
+            //with a profile only the loop nests that ran and took at least -autopim-min-hotness of the
+            //profiled time are offloaded. The average trips of their innermost loops are kept for the
+            //kernels whose range is only known at runtime.
+            bool isLoopNestHot(Loop* loop, const std::string& name) {
+                auto nest = profile.find(name);
+                if (nest == profile.end() || nest->second.entries == 0) {
+                    report() << "\n[Loop Profile Report] loop nest " << name << " never ran in the profile, it stays on the host.\n";
+                    remarkMissed(loop, "Cold", "the loop nest never ran in the profile");
+                    return false;
+                }
+
+                double hotness = profile_nanoseconds > 0 ? nest->second.nanoseconds / profile_nanoseconds : 1;
+                report() << "\n[Loop Profile Report] loop nest " << name << " ran " << nest->second.entries << " time(s), "
+                       << format("%.1f%%", hotness * 100) << " of the profiled time";
+                if (hotness < MinHotness) {
+                    report() << ", it stays on the host.\n";
+                    remarkMissed(loop, "Cold", "the loop nest takes too little of the profiled time");
+                    return false;
+                }
+                report() << ".\n";
+
+                unsigned int innermost = 0;
+                for (auto sub_loop : loop->getLoopsInPreorder()) {
+                    if (!sub_loop->isInnermost()) {
+                        continue;
+                    }
+                    auto counter = profile.find(name + "." + std::to_string(innermost++));
+                    if (counter != profile.end() && counter->second.entries > 0) {
+                        profile_trips[sub_loop] = counter->second.iterations / counter->second.entries;
+                    }
+                }
+                profile_calls = nest->second.entries;
+                return true;
+            }
+
+            //the pass object lives for the whole module, so the files are only read once
+            void loadInputs() {
+                if (target_loaded) {
+                    return;
+                }
+                target_loaded = true;
+                if (!TargetFile.empty()) {
+                    loadTarget();
+                }
+                if (!TuneCache.empty()) {
+                    loadTuneCache();
+                }
+                if (!ProfileFile.empty() && !Instrument) {
+                    profile_loaded = loadProfile();
+                }
+            }
+
+            //walk the top-level loops of the function in the order LoopInfo keeps them, the analyses
+            //come from the pass manager's cache and are kept up to date while loops are replaced
+            PreservedAnalyses run(Function& function, FunctionAnalysisManager& FAM) {
+                //the clones of the host fallback are already what was left on the host
+                if (function.hasFnAttribute("autopim-host-loop")) {
+                    return PreservedAnalyses::all();
+                }
+
+                auto& loop_info = FAM.getResult<LoopAnalysis>(function);
+                auto& scalar_evolution = FAM.getResult<ScalarEvolutionAnalysis>(function);
+                auto& dominator_tree = FAM.getResult<DominatorTreeAnalysis>(function);
+                auto& assumption_cache = FAM.getResult<AssumptionAnalysis>(function);
+                tti = &FAM.getResult<TargetIRAnalysis>(function);
+                se = &scalar_evolution;
+                dt = &dominator_tree;
+                aa = &FAM.getResult<AAManager>(function);
+                di = &FAM.getResult<DependenceAnalysis>(function);
+                ore = &FAM.getResult<OptimizationRemarkEmitterAnalysis>(function);
+
+                loadInputs();
+
+                bool changed = false;
+                SmallVector<Loop*, 8> loops(loop_info.begin(), loop_info.end());
+                unsigned int nest_num = 0;
+                for (auto loop : loops) {
+                    changed |= simplifyLoop(loop, &dominator_tree, &loop_info, &scalar_evolution, &assumption_cache, nullptr, false);
+
+                    //loop nests are named by function and position, the same in the instrumented build
+                    //and in the builds that read its profile
+                    auto nest_name = (function.getName() + ":" + Twine(nest_num++)).str();
+                    if (Instrument) {
+                        changed |= instrumentLoopNest(loop, nest_name);
+                        continue;
+                    }
+                    if (profile_loaded && !isLoopNestHot(loop, nest_name)) {
+                        continue;
+                    }
+
+                    //rebuilt per loop since erasing earlier sub-loops invalidates its cached results
+                    demanded_bits = std::make_unique<DemandedBits>(function, assumption_cache, dominator_tree);
+                    changed |= runOnLoop(loop, {}, loop_info, scalar_evolution, dominator_tree);
+                    profile_trips.clear();
+                    profile_calls = 1;
+                }
+                demanded_bits.reset();
+                ast_nodes.clear();
+                rewritten_nodes.clear();
+                leaf_addresses.clear();
+                ast_arena.Reset();
+                if (tune_cache_dirty && !TuneCache.empty()) {
+                    saveTuneCache();
+                }
+                return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+            }
+
+            static bool isRequired() {
                 return true;
             }
+    };
+
+    //-passes=autopim over the whole module: every function is put in the form the generator expects and
+    //transformed, in module order like a function pipeline would. With -autopim-area-budget the module is
+    //planned first, so the budget goes to the kernels that save the most anywhere in it.
+    class PIMModuleGenerator : public PassInfoMixin<PIMModuleGenerator> {
+        public:
+            PreservedAnalyses run(Module& module, ModuleAnalysisManager& MAM) {
+                auto& FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+                FunctionPassManager prepare;
+                prepare.addPass(PromotePass());
+                prepare.addPass(LoopSimplifyPass());
+                prepare.addPass(createFunctionToLoopPassAdaptor(IndVarSimplifyPass()));
+
+                PIMGenerator generator;
+                generator.loadInputs();
+                auto preserved = PreservedAnalyses::all();
+                if (AreaBudget > 0 && !Instrument) {
+                    //kernels emitted while planning are erased again, so they are numbered from the start
+                    generator.planning = true;
+                    preserved.intersect(runOnFunctions(module, FAM, prepare, generator));
+                    generator.planning = false;
+                    generator.kernel_count = 0;
+                    generator.selectKernels();
+                }
+                preserved.intersect(runOnFunctions(module, FAM, prepare, generator));
+                return preserved;
+            }
+
+            //functions added while the module is walked, the kernels and host loops, are walked too
+            PreservedAnalyses runOnFunctions(Module& module, FunctionAnalysisManager& FAM, FunctionPassManager& prepare, PIMGenerator& generator) {
+                auto preserved = PreservedAnalyses::all();
+                for (auto& function : module) {
+                    if (function.isDeclaration()) {
+                        continue;
+                    }
+                    preserved.intersect(prepare.run(function, FAM));
+                    auto generated = generator.run(function, FAM);
+                    FAM.invalidate(function, generated);
+                    preserved.intersect(std::move(generated));
+                }
+                //like the module adaptor of a function pipeline, the function analyses were invalidated one by one
+                preserved.preserveSet<AllAnalysesOn<Function>>();
+                preserved.preserve<FunctionAnalysisManagerModuleProxy>();
+                return preserved;
+            }
 
-            virtual void getAnalysisUsage(AnalysisUsage& AU) const {
-                AU.addRequiredID(LoopSimplifyID);
-                AU.addRequired<ScalarEvolutionWrapperPass>();
-                AU.addRequired<DominatorTreeWrapperPass>();
-                AU.addRequired<LoopInfoWrapperPass>();
+            static bool isRequired() {
+                return true;
             }
     };
+}
 
-    char PIMGenerator::ID = 0;
-    RegisterPass<PIMGenerator> PIMG("autopim", "15745 PIM Architecture Generator");
+//-passes=autopim runs the whole flow over the module: promote to SSA, canonicalize the
+//induction variables, then generate the PIM kernels, within an area budget if there is one.
+//Nested in a function pipeline it runs function by function without a budget, and
+//autopim-generate only runs the last step, for pipelines that already put the loops in that form.
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "autopim", "v0.1", [](PassBuilder& PB) {
+        PB.registerPipelineParsingCallback([](StringRef name, ModulePassManager& MPM, ArrayRef<PassBuilder::PipelineElement>) {
+            if (name == "autopim") {
+                MPM.addPass(PIMModuleGenerator());
+                return true;
+            }
+            return false;
+        });
+        PB.registerPipelineParsingCallback([](StringRef name, FunctionPassManager& FPM, ArrayRef<PassBuilder::PipelineElement>) {
+            if (name == "autopim") {
+                FPM.addPass(PromotePass());
+                FPM.addPass(LoopSimplifyPass());
+                FPM.addPass(createFunctionToLoopPassAdaptor(IndVarSimplifyPass()));
+                FPM.addPass(PIMGenerator());
+                return true;
+            }
+            if (name == "autopim-generate") {
+                FPM.addPass(PIMGenerator());
+                return true;
+            }
+            return false;
+        });
+    }};
 }
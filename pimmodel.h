@@ -0,0 +1,313 @@
+//15-745 S20 Project: Optimizing for Processing-In-Memory
+//Angela Li (quinyanl), Siddharth Sahay (ssahay2)
+//autopim/pimmodel.h: DRAM timing and energy model of the PIM unit
+//Shared by the pass, which predicts whether offloading a loop pays off with it, and the
+//runtime simulator, which costs every dispatch with it. The parameters of the default
+//target can be overridden with -D, as long as the pass and the runtime are built with the
+//same values. Other targets are described by a struct pim_target.
+
+#ifndef AUTOPIM_PIMMODEL_H
+#define AUTOPIM_PIMMODEL_H
+
+#include "runtime.h"
+
+//DRAM geometry, a sub-loop can be spread over up to PIM_MAX_BANKS banks
+#ifndef PIM_BANKS
+#define PIM_BANKS 16
+#endif
+#ifndef PIM_MAX_BANKS
+#define PIM_MAX_BANKS 1024
+#endif
+#ifndef PIM_ROW_BYTES
+#define PIM_ROW_BYTES 8192
+#endif
+
+//timing parameters, in memory controller cycles
+#ifndef PIM_ACTIVATE_CYCLES
+#define PIM_ACTIVATE_CYCLES 35   //open a row into the row buffer
+#endif
+#ifndef PIM_ROWOP_CYCLES
+#define PIM_ROWOP_CYCLES 49      //one activate-activate-precharge row operation
+#endif
+#ifndef PIM_DISPATCH_CYCLES
+#define PIM_DISPATCH_CYCLES 200  //host to PIM command over the memory bus
+#endif
+#ifndef PIM_CLOCK_MHZ
+#define PIM_CLOCK_MHZ 1200       //used to line simulated cycles up with host time
+#endif
+#ifndef PIM_COMMAND_CYCLES
+#define PIM_COMMAND_CYCLES 8     //each additional command in a batched dispatch
+#endif
+#ifndef PIM_TRANSPOSE_CYCLES
+#define PIM_TRANSPOSE_CYCLES 64  //corner-turn one row into its packed layout
+#endif
+
+//energy parameters, in nJ
+#ifndef PIM_ACTIVATE_NJ
+#define PIM_ACTIVATE_NJ 1.0      //activate and precharge one row
+#endif
+#ifndef PIM_ROWOP_NJ
+#define PIM_ROWOP_NJ 2.5         //triple row activation of a row operation
+#endif
+#ifndef PIM_DISPATCH_NJ
+#define PIM_DISPATCH_NJ 10.0     //command buffer over the memory bus
+#endif
+
+//host side, what the PIM unit is compared against
+#ifndef PIM_HOST_BYTES_PER_CYCLE
+#define PIM_HOST_BYTES_PER_CYCLE 8   //sustained memory bandwidth of a streaming loop
+#endif
+#ifndef PIM_HOST_CYCLE_NJ
+#define PIM_HOST_CYCLE_NJ 0.5        //core and caches, per cycle
+#endif
+#ifndef PIM_HOST_BYTE_NJ
+#define PIM_HOST_BYTE_NJ 0.15        //moving a byte between DRAM and the core
+#endif
+
+#define PIM_NUM_OPS (PIM_OP_SELECT + 1)
+
+//a PIM target: DRAM geometry, timing and energy, and the host it is compared against. The
+//pass reads targets other than the default one from a description file and hands them to the
+//runtime with pim_settarget. op_cycles and op_nj are the cost of one row operation of a
+//micro-op, 0 keeps rowop_cycles and rowop_nj.
+struct pim_target {
+    unsigned int banks;
+    unsigned int row_bytes;
+    unsigned int clock_mhz;
+    unsigned int activate_cycles;
+    unsigned int rowop_cycles;
+    unsigned int dispatch_cycles;
+    unsigned int command_cycles;
+    unsigned int transpose_cycles;
+    double activate_nj;
+    double rowop_nj;
+    double dispatch_nj;
+    double host_bytes_per_cycle;
+    double host_cycle_nj;
+    double host_byte_nj;
+    unsigned int op_cycles[PIM_NUM_OPS];
+    double op_nj[PIM_NUM_OPS];
+};
+
+#define PIM_DEFAULT_TARGET {PIM_BANKS, PIM_ROW_BYTES, PIM_CLOCK_MHZ, PIM_ACTIVATE_CYCLES, PIM_ROWOP_CYCLES, \
+                            PIM_DISPATCH_CYCLES, PIM_COMMAND_CYCLES, PIM_TRANSPOSE_CYCLES, PIM_ACTIVATE_NJ, \
+                            PIM_ROWOP_NJ, PIM_DISPATCH_NJ, PIM_HOST_BYTES_PER_CYCLE, PIM_HOST_CYCLE_NJ, \
+                            PIM_HOST_BYTE_NJ, {0}, {0}}
+
+struct pim_estimate {
+    unsigned long long cycles;
+    unsigned long long row_activations;
+    unsigned long long bytes_moved;
+    double energy_nj;
+};
+
+static inline unsigned long long pim_ceil_div(unsigned long long a, unsigned long long b) {
+    return (a + b - 1) / b;
+}
+
+static inline unsigned long long pim_ceil_log2(unsigned long long n) {
+    unsigned long long steps = 0;
+    while ((1ULL << steps) < n) {
+        steps++;
+    }
+    return steps;
+}
+
+static inline unsigned int pim_insn_bits(int insn) {
+    unsigned int bits = PIM_INSN_BITS(insn);
+    return bits == 0 ? 32 : bits;
+}
+
+//number of row operations needed to apply a micro-op to one row of operands
+//bitwise ops work on the whole row at once, arithmetic is bit-serial
+static inline unsigned long long pim_rowops(int op, unsigned int bits) {
+    switch (op) {
+        case PIM_OP_AND:
+        case PIM_OP_OR:
+        case PIM_OP_XOR:
+        case PIM_OP_SHIFT:
+            return 1;
+
+        case PIM_OP_ADD:
+        case PIM_OP_SUB:
+            return bits + 1;
+
+        case PIM_OP_CMP:
+            return bits;
+
+        //compare, then blend the two rows through the resulting mask
+        case PIM_OP_MIN:
+        case PIM_OP_MAX:
+            return bits + 3;
+
+        //and the true row with the mask, the false row with its complement, or them together
+        case PIM_OP_SELECT:
+            return 3;
+
+        case PIM_OP_MUL:
+            return (unsigned long long)bits * bits;
+
+        case PIM_OP_DIV:
+            return 2ULL * bits * bits;
+
+        default:
+            return 0;
+    }
+}
+
+//cycles and energy of one row operation of a micro-op
+static inline unsigned long long pim_rowop_cycles(const struct pim_target* target, int op) {
+    return target->op_cycles[op] != 0 ? target->op_cycles[op] : target->rowop_cycles;
+}
+
+static inline double pim_rowop_nj(const struct pim_target* target, int op) {
+    return target->op_nj[op] != 0 ? target->op_nj[op] : target->rowop_nj;
+}
+
+//widest micro-op of a program, every operand of a tile has to fit its rows
+static inline unsigned int pim_program_bits(const int* program, int program_len) {
+    unsigned int bits = 1;
+    for (int i = 0; i < program_len; i++) {
+        unsigned int insn_bits = pim_insn_bits(program[i]);
+        bits = insn_bits > bits ? insn_bits : bits;
+    }
+    return bits;
+}
+
+//the default tile is one row of the widest operand
+static inline unsigned long long pim_default_tile(const struct pim_target* target, const int* program, int program_len) {
+    return (target->row_bytes * 8ULL) / pim_program_bits(program, program_len);
+}
+
+//rows a micro-op touches for one tile of the given number of elements
+static inline unsigned long long pim_tile_rows(const struct pim_target* target, int insn, unsigned long long elements) {
+    if (PIM_INSN_LAYOUT(insn) == PIM_LAYOUT_STRIDED) {
+        //walking a column opens a different row for every element
+        return elements;
+    }
+    return pim_ceil_div(elements * pim_insn_bits(insn), target->row_bytes * 8ULL);
+}
+
+//add the cost of running a sub-loop program over inner_elements elements for outer_count
+//outer iterations as one bulk operation. The inner range of every outer iteration is
+//strip-mined into tiles of tile_elements elements, the last one partial when the range
+//does not divide evenly, and the tiles are dealt round-robin to the banks, which all work
+//in parallel. The cost is the cycles of the busiest bank plus any serial steps, dispatch
+//overhead is added separately by pim_estimate_dispatch. A tile_elements or banks of 0
+//selects one row of the widest operand and all banks of the target.
+static inline void pim_estimate_program(const struct pim_target* target, const int* program, int program_len, unsigned long long inner_elements,
+                                        unsigned long long outer_count, unsigned long long tile_elements,
+                                        unsigned int banks, struct pim_estimate* estimate) {
+    unsigned long long bank_cycles[PIM_MAX_BANKS];
+    unsigned long long slowest = 0;
+    unsigned long long serial = 0;
+    unsigned long long full_cycles = 0;     //one full tile of every outer iteration
+    unsigned long long partial_cycles = 0;  //the remainder tile
+    unsigned long long resident_full = 0;   //accumulator tiles, touched once and not per outer iteration
+    unsigned long long resident_partial = 0;
+
+    if (inner_elements == 0 || outer_count == 0) {
+        return;
+    }
+    if (tile_elements == 0) {
+        tile_elements = pim_default_tile(target, program, program_len);
+    }
+    if (banks == 0) {
+        banks = target->banks;
+    }
+    if (banks > PIM_MAX_BANKS) {
+        banks = PIM_MAX_BANKS;
+    }
+
+    unsigned long long tiles = pim_ceil_div(inner_elements, tile_elements);
+    unsigned long long remainder = inner_elements % tile_elements;
+    unsigned long long partial_elements = remainder ? remainder : tile_elements;
+
+    for (unsigned int bank = 0; bank < banks; bank++) {
+        bank_cycles[bank] = 0;
+    }
+
+    for (int i = 0; i < program_len; i++) {
+        int op = PIM_INSN_OP(program[i]);
+        unsigned int bits = pim_insn_bits(program[i]);
+        unsigned long long full_rows = pim_tile_rows(target, program[i], tile_elements);
+        unsigned long long partial_rows = pim_tile_rows(target, program[i], partial_elements);
+        unsigned long long rows = (tiles - 1) * full_rows + partial_rows;   //one outer iteration
+        int memory = op == PIM_OP_LOAD || op == PIM_OP_STORE;
+        unsigned long long row_cycles = memory ? target->activate_cycles : pim_rowops(op, bits) * pim_rowop_cycles(target, op);
+        double row_nj = memory ? target->activate_nj : pim_rowops(op, bits) * pim_rowop_nj(target, op);
+        if (PIM_INSN_IS_MASKED(program[i])) {
+            //the old row is blended with the new one before it is written back
+            row_cycles += pim_rowops(PIM_OP_SELECT, bits) * pim_rowop_cycles(target, PIM_OP_SELECT);
+            row_nj += pim_rowops(PIM_OP_SELECT, bits) * pim_rowop_nj(target, PIM_OP_SELECT);
+        }
+
+        if (PIM_INSN_IS_REDUCE(program[i])) {
+            if (memory) {
+                //the accumulator tiles are only read in before and written back after the reduction
+                resident_full += full_rows * row_cycles;
+                resident_partial += partial_rows * row_cycles;
+                estimate->row_activations += rows;
+                estimate->bytes_moved += (inner_elements * bits + 7) / 8;
+                estimate->energy_nj += rows * row_nj;
+            }
+            else {
+                //tree reduction, one accumulator tile at a time: every bank folds its share of
+                //the outer rows into a local accumulator, then the banks combine pairwise
+                unsigned long long reduce_banks = outer_count < banks ? outer_count : banks;
+                unsigned long long steps = pim_ceil_div(outer_count, banks) + pim_ceil_log2(reduce_banks);
+                serial += steps * rows * row_cycles;
+                estimate->energy_nj += (outer_count + reduce_banks - 1) * rows * row_nj;
+            }
+            continue;
+        }
+
+        full_cycles += full_rows * row_cycles;
+        partial_cycles += partial_rows * row_cycles;
+        estimate->energy_nj += outer_count * rows * row_nj;
+        if (memory) {
+            estimate->row_activations += outer_count * rows;
+            estimate->bytes_moved += (outer_count * inner_elements * bits + 7) / 8;
+        }
+    }
+
+    //deal the tiles of all outer iterations to the banks, the remainder tile closes every outer iteration
+    for (unsigned long long tile = 0; tile < outer_count * tiles; tile++) {
+        int last = tile % tiles == tiles - 1;
+        bank_cycles[tile % banks] += last ? partial_cycles : full_cycles;
+        if (tile < tiles) {
+            bank_cycles[tile % banks] += last ? resident_partial : resident_full;
+        }
+    }
+
+    for (unsigned int bank = 0; bank < banks; bank++) {
+        if (bank_cycles[bank] > slowest) {
+            slowest = bank_cycles[bank];
+        }
+    }
+    estimate->cycles += slowest + serial;
+}
+
+//add the cost of converting the first elements of an array into a packed layout: the rows
+//holding it are read, corner-turned and written out again, spread over all banks
+static inline void pim_estimate_pack(const struct pim_target* target, unsigned long long elements, unsigned int element_bits, unsigned int packed_bits,
+                                     struct pim_estimate* estimate) {
+    unsigned long long src_bytes = (elements * element_bits + 7) / 8;
+    unsigned long long dst_bytes = (elements * packed_bits + 7) / 8;
+    unsigned long long src_rows = pim_ceil_div(src_bytes, target->row_bytes);
+    unsigned long long dst_rows = pim_ceil_div(dst_bytes, target->row_bytes);
+
+    estimate->cycles += pim_ceil_div(src_rows + dst_rows, target->banks) * target->activate_cycles +
+                        pim_ceil_div(src_rows, target->banks) * target->transpose_cycles;
+    estimate->row_activations += src_rows + dst_rows;
+    estimate->bytes_moved += src_bytes + dst_bytes;
+    estimate->energy_nj += (src_rows + dst_rows) * target->activate_nj;
+}
+
+//add the cost of shipping a command buffer holding num_commands commands
+static inline void pim_estimate_dispatch(const struct pim_target* target, unsigned long long num_commands, struct pim_estimate* estimate) {
+    estimate->cycles += target->dispatch_cycles + num_commands * target->command_cycles;
+    estimate->energy_nj += target->dispatch_nj;
+}
+
+#endif
@@ -0,0 +1,549 @@
+//15-745 S20 Project: Optimizing for Processing-In-Memory
+//Angela Li (quinyanl), Siddharth Sahay (ssahay2)
+//autopim/runtime.c: Functional PIM runtime simulator
+//Kernels registered by the pass are executed on the host so the transformed
+//program computes real results. Each dispatch is also run through the DRAM
+//model in pimmodel.h: the sub-loop range is laid out across rows, rows are
+//interleaved over the banks, and the banks execute their rows in parallel.
+
+#include "runtime.h"
+#include "pimmodel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//host cost estimates, in host cycles per element
+#ifndef PIM_HOST_MEM_CYCLES
+#define PIM_HOST_MEM_CYCLES 4
+#endif
+#ifndef PIM_HOST_MUL_CYCLES
+#define PIM_HOST_MUL_CYCLES 3
+#endif
+#ifndef PIM_HOST_DIV_CYCLES
+#define PIM_HOST_DIV_CYCLES 20
+#endif
+
+//elements of a host fallback chunk, shorter ranges are not worth waking up other threads for
+#ifndef PIM_HOST_CHUNK
+#define PIM_HOST_CHUNK 1024
+#endif
+
+#define PIM_MAX_SUBLOOPS 1024
+#define PIM_MAX_PROGRAM 256
+#define PIM_MAX_COMMANDS 64
+#define PIM_MAX_TICKETS 256
+#define PIM_MAX_LAYOUTS 64
+#define PIM_MAX_PROFILES 1024
+
+struct pim_subloop {
+    pim_kernel_fn kernel;
+    int program[PIM_MAX_PROGRAM];
+    int program_len;
+    int range_start;
+    int range_end;
+    int tile_elements;
+    int banks;
+    int registered;
+};
+
+//a batched command covers a sub-loop for a whole range of outer indices
+struct pim_command {
+    int subloop_num;
+    int range_start;
+    int range_end;
+    int outer_start;
+    int outer_end;
+    void** operands;
+};
+
+//completion of a submitted command buffer on the simulated timeline
+struct pim_ticket {
+    double done;
+    unsigned long long cycles;
+    int waited;
+};
+
+//a packed shadow copy of an array made by pim_pack
+struct pim_packed {
+    const void* base;
+    int elements;
+    int element_bits;
+    int packed_bits;
+    int layout;
+};
+
+//counters of a loop nest or innermost loop of an instrumented build
+struct pim_profile {
+    const char* name;
+    unsigned long long entries;
+    unsigned long long iterations;
+    double nanoseconds;
+    double entered;
+    int depth;      //recursive calls of the nest are timed by the outermost one
+};
+
+static struct pim_subloop subloops[PIM_MAX_SUBLOOPS];
+static int num_subloops;
+static struct pim_command commands[PIM_MAX_COMMANDS];
+static int num_commands;
+static struct pim_ticket tickets[PIM_MAX_TICKETS];
+static int next_ticket = 1;
+static struct pim_packed packed[PIM_MAX_LAYOUTS];
+static int num_packed;
+static struct pim_stats stats;
+static struct pim_target target = PIM_DEFAULT_TARGET;
+static struct pim_profile profiles[PIM_MAX_PROFILES];
+static int num_profiles;
+
+//the host timeline is wall clock time minus the time the simulator itself spends
+//executing kernels, plus the time the host spent stalled waiting on the PIM unit
+static double excluded_ns;
+static double stalled_ns;
+static double pim_busy_until;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double host_time_ns(double wall_ns) {
+    return wall_ns - excluded_ns + stalled_ns;
+}
+
+static struct pim_subloop* lookup(int subloop_num) {
+    if (subloop_num < 0 || subloop_num >= num_subloops) {
+        fprintf(stderr, "[PIM Runtime] invalid sub-loop %d\n", subloop_num);
+        return NULL;
+    }
+    return &subloops[subloop_num];
+}
+
+static unsigned long long host_cost(int op) {
+    switch (op) {
+        case PIM_OP_LOAD:
+        case PIM_OP_STORE:
+            return PIM_HOST_MEM_CYCLES;
+
+        case PIM_OP_MUL:
+            return PIM_HOST_MUL_CYCLES;
+
+        case PIM_OP_DIV:
+            return PIM_HOST_DIV_CYCLES;
+
+        case PIM_OP_NOP:
+        case PIM_OP_CONSTANT:
+            return 0;
+
+        default:
+            return 1;
+    }
+}
+
+//account for running a sub-loop program over inner_elements elements for outer_count
+//outer iterations, returns the PIM cycles, dispatch overhead is accounted for by the caller
+static unsigned long long simulate(const struct pim_subloop* sl, unsigned long long inner_elements, unsigned long long outer_count) {
+    struct pim_estimate estimate;
+    unsigned long long num_elements = inner_elements * outer_count;
+    memset(&estimate, 0, sizeof(estimate));
+
+    pim_estimate_program(&target, sl->program, sl->program_len, inner_elements, outer_count,
+                         (unsigned long long)sl->tile_elements, (unsigned int)sl->banks, &estimate);
+    for (int i = 0; i < sl->program_len; i++) {
+        stats.host_cycles += num_elements * host_cost(PIM_INSN_OP(sl->program[i]));
+    }
+
+    stats.row_activations += estimate.row_activations;
+    stats.bytes_moved += estimate.bytes_moved;
+    stats.energy_nj += estimate.energy_nj;
+    stats.elements += num_elements;
+    return estimate.cycles;
+}
+
+static int check_kernel(const struct pim_subloop* sl, int subloop_num) {
+    if (!sl->registered || !sl->kernel) {
+        fprintf(stderr, "[PIM Runtime] no kernel registered for sub-loop %d\n", subloop_num);
+        return 0;
+    }
+    return 1;
+}
+
+static void run_kernel(const struct pim_subloop* sl, int range_start, int range_end, int outer_index, void** operands) {
+    for (long index = range_start; index < range_end; index++) {
+        sl->kernel(outer_index, index, operands);
+    }
+}
+
+//the handles are handed out across all modules, the pass only numbers kernels within one
+int pim_registerkernel(pim_kernel_fn kernel, const int* program, int program_len) {
+    struct pim_subloop* sl;
+    if (num_subloops == PIM_MAX_SUBLOOPS) {
+        fprintf(stderr, "[PIM Runtime] too many kernels\n");
+        return -1;
+    }
+
+    if (program_len < 0 || program_len > PIM_MAX_PROGRAM) {
+        fprintf(stderr, "[PIM Runtime] program for sub-loop %d is too long\n", num_subloops);
+        return -1;
+    }
+
+    sl = &subloops[num_subloops];
+    sl->kernel = kernel;
+    sl->program_len = program_len;
+    if (program_len > 0) {
+        memcpy(sl->program, program, program_len * sizeof(int));
+    }
+    sl->registered = 1;
+    return num_subloops++;
+}
+
+int pim_initsubloop(int subloop_num, int range_start, int range_end) {
+    struct pim_subloop* sl = lookup(subloop_num);
+    if (!sl) {
+        return -1;
+    }
+
+    sl->range_start = range_start;
+    sl->range_end = range_end;
+    return 0;
+}
+
+int pim_tilesubloop(int subloop_num, int tile_elements, int banks) {
+    struct pim_subloop* sl = lookup(subloop_num);
+    if (!sl) {
+        return -1;
+    }
+
+    if (tile_elements < 0 || banks < 0 || banks > PIM_MAX_BANKS) {
+        fprintf(stderr, "[PIM Runtime] invalid tiling for sub-loop %d\n", subloop_num);
+        return -1;
+    }
+
+    sl->tile_elements = tile_elements;
+    sl->banks = banks;
+    return 0;
+}
+
+static int queue_command(int subloop_num, int outer_start, int outer_end, void** operands) {
+    struct pim_subloop* sl = lookup(subloop_num);
+    if (!sl || !check_kernel(sl, subloop_num)) {
+        return -1;
+    }
+
+    if (num_commands == PIM_MAX_COMMANDS) {
+        pim_flush();
+    }
+
+    //the range of the sub-loop is captured when the command is queued
+    commands[num_commands].subloop_num = subloop_num;
+    commands[num_commands].range_start = sl->range_start;
+    commands[num_commands].range_end = sl->range_end;
+    commands[num_commands].outer_start = outer_start;
+    commands[num_commands].outer_end = outer_end;
+    commands[num_commands].operands = operands;
+    num_commands++;
+    return 0;
+}
+
+int pim_runindex(int subloop_num, int outer_index, void** operands) {
+    if (queue_command(subloop_num, outer_index, outer_index + 1, operands) < 0) {
+        return -1;
+    }
+    return pim_flush();
+}
+
+int pim_launch(int subloop_num, int outer_index, void** operands) {
+    if (queue_command(subloop_num, outer_index, outer_index + 1, operands) < 0) {
+        return -1;
+    }
+    return pim_submit();
+}
+
+int pim_runrange(int subloop_num, int outer_start, int outer_end, void** operands) {
+    return queue_command(subloop_num, outer_start, outer_end, operands);
+}
+
+//place a dispatch of the given length on the PIM timeline, it starts once the PIM unit is
+//done with whatever was dispatched before it, returns its ticket
+static int schedule(double start, unsigned long long cycles) {
+    int ticket = next_ticket;
+    struct pim_ticket* slot = &tickets[ticket % PIM_MAX_TICKETS];
+
+    stats.cycles += cycles;
+    stats.dispatches++;
+
+    double issue = host_time_ns(start);
+    double begin = issue > pim_busy_until ? issue : pim_busy_until;
+    pim_busy_until = begin + cycles * 1000.0 / target.clock_mhz;
+
+    slot->done = pim_busy_until;
+    slot->cycles = cycles;
+    slot->waited = 0;
+    next_ticket++;
+    return ticket;
+}
+
+int pim_submit(void) {
+    double start = now_ns();
+    unsigned long long cycles = 0;
+    struct pim_estimate dispatch;
+    int ticket;
+
+    if (num_commands == 0) {
+        return next_ticket - 1;
+    }
+
+    //commands are executed right away: the pass only lets the host touch memory a command
+    //uses after waiting for its ticket, so this is indistinguishable from running later
+    for (int i = 0; i < num_commands; i++) {
+        struct pim_command* command = &commands[i];
+        struct pim_subloop* sl = &subloops[command->subloop_num];
+
+        for (int outer = command->outer_start; outer < command->outer_end; outer++) {
+            run_kernel(sl, command->range_start, command->range_end, outer, command->operands);
+        }
+
+        //the whole iteration space is laid out across rows and banks as one bulk operation
+        if (command->range_end > command->range_start && command->outer_end > command->outer_start) {
+            cycles += simulate(sl, (unsigned long long)(command->range_end - command->range_start),
+                               (unsigned long long)(command->outer_end - command->outer_start));
+        }
+    }
+
+    //the command buffer goes over the bus in a single dispatch
+    memset(&dispatch, 0, sizeof(dispatch));
+    pim_estimate_dispatch(&target, num_commands, &dispatch);
+    stats.energy_nj += dispatch.energy_nj;
+    num_commands = 0;
+
+    ticket = schedule(start, cycles + dispatch.cycles);
+    excluded_ns += now_ns() - start;
+    return ticket;
+}
+
+int pim_wait(int ticket) {
+    double start = now_ns();
+    struct pim_ticket* slot = &tickets[ticket % PIM_MAX_TICKETS];
+
+    //tickets that fell out of the table finished long ago
+    if (ticket <= 0 || ticket >= next_ticket || ticket <= next_ticket - PIM_MAX_TICKETS || slot->waited) {
+        return 0;
+    }
+
+    double now = host_time_ns(start);
+    unsigned long long stall = 0;
+    if (slot->done > now) {
+        stall = (unsigned long long)((slot->done - now) * target.clock_mhz / 1000.0);
+        //the host sits idle until the PIM unit is done
+        stalled_ns += slot->done - now;
+    }
+
+    stats.stall_cycles += stall;
+    stats.hidden_cycles += stall < slot->cycles ? slot->cycles - stall : 0;
+    slot->waited = 1;
+
+    excluded_ns += now_ns() - start;
+    return 0;
+}
+
+int pim_flush(void) {
+    int ticket = pim_submit();
+    if (ticket < 0) {
+        return ticket;
+    }
+    return pim_wait(ticket);
+}
+
+static struct pim_packed* find_packed(const void* base, int layout) {
+    for (int i = 0; i < num_packed; i++) {
+        if (packed[i].base == base && packed[i].layout == layout) {
+            return &packed[i];
+        }
+    }
+    return NULL;
+}
+
+//the conversion is costed with the DRAM model and runs as a dispatch of its own
+int pim_pack(const void* base, int elements, int element_bits, int packed_bits, int layout) {
+    double start = now_ns();
+    struct pim_packed* shadow = find_packed(base, layout);
+    struct pim_estimate estimate;
+
+    if (elements <= 0 || element_bits <= 0 || packed_bits <= 0) {
+        return -1;
+    }
+
+    //a live shadow in the same layout is shared
+    if (shadow && shadow->packed_bits >= packed_bits && shadow->elements >= elements) {
+        return 0;
+    }
+
+    if (!shadow) {
+        if (num_packed == PIM_MAX_LAYOUTS) {
+            fprintf(stderr, "[PIM Runtime] too many packed arrays\n");
+            return -1;
+        }
+        shadow = &packed[num_packed++];
+    }
+
+    shadow->base = base;
+    shadow->elements = elements;
+    shadow->element_bits = element_bits;
+    shadow->packed_bits = packed_bits;
+    shadow->layout = layout;
+
+    memset(&estimate, 0, sizeof(estimate));
+    pim_estimate_pack(&target, elements, element_bits, packed_bits, &estimate);
+    pim_estimate_dispatch(&target, 1, &estimate);
+
+    stats.row_activations += estimate.row_activations;
+    stats.bytes_moved += estimate.bytes_moved;
+    stats.energy_nj += estimate.energy_nj;
+    stats.layout_cycles += estimate.cycles;
+    schedule(start, estimate.cycles);
+
+    excluded_ns += now_ns() - start;
+    return 0;
+}
+
+//the pass only packs arrays the function never writes, so the shadows are dropped without
+//being converted back
+int pim_unpack(const void* base) {
+    for (int i = 0; i < num_packed; ) {
+        if (packed[i].base == base) {
+            packed[i] = packed[--num_packed];
+        }
+        else {
+            i++;
+        }
+    }
+    return 0;
+}
+
+//the chunks are spread over the cores with OpenMP when the runtime is built with -fopenmp,
+//and run one after the other otherwise
+int pim_hostrange(pim_host_fn fn, int range_start, int range_end, void** operands) {
+    long elements = (long)range_end - range_start;
+    if (elements <= 0) {
+        return 0;
+    }
+
+    long chunks = (elements + PIM_HOST_CHUNK - 1) / PIM_HOST_CHUNK;
+    #pragma omp parallel for schedule(static) if (chunks > 1)
+    for (long chunk = 0; chunk < chunks; chunk++) {
+        long start = range_start + chunk * PIM_HOST_CHUNK;
+        long end = start + PIM_HOST_CHUNK < range_end ? start + PIM_HOST_CHUNK : range_end;
+        fn(start, end, operands);
+    }
+    stats.host_elements += elements;
+    return 0;
+}
+
+int pim_settarget(const struct pim_target* new_target) {
+    if (new_target->banks == 0 || new_target->banks > PIM_MAX_BANKS || new_target->row_bytes == 0 || new_target->clock_mhz == 0) {
+        fprintf(stderr, "[PIM Runtime] invalid target\n");
+        return -1;
+    }
+    target = *new_target;
+    return 0;
+}
+
+static struct pim_profile* lookup_profile(int profile_num) {
+    if (profile_num < 0 || profile_num >= num_profiles) {
+        fprintf(stderr, "[PIM Runtime] invalid profile counter %d\n", profile_num);
+        return NULL;
+    }
+    return &profiles[profile_num];
+}
+
+//one line per counter: name, entries, iterations and nanoseconds
+static void write_profile(void) {
+    const char* path = getenv("AUTOPIM_PROFILE");
+    path = path != NULL ? path : "autopim.profile";
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "[PIM Runtime] cannot write the profile to %s\n", path);
+        return;
+    }
+    fprintf(file, "#autopim profile: name entries iterations nanoseconds\n");
+    for (int i = 0; i < num_profiles; i++) {
+        fprintf(file, "%s %llu %llu %.0f\n", profiles[i].name, profiles[i].entries, profiles[i].iterations, profiles[i].nanoseconds);
+    }
+    fclose(file);
+}
+
+//the handles are handed out across all modules, the pass only numbers counters within one
+int pim_profileloop(const char* name) {
+    if (num_profiles == PIM_MAX_PROFILES) {
+        fprintf(stderr, "[PIM Runtime] too many profile counters\n");
+        return -1;
+    }
+    if (num_profiles == 0) {
+        atexit(write_profile);
+    }
+    profiles[num_profiles].name = name;
+    return num_profiles++;
+}
+
+int pim_profileenter(int profile_num) {
+    struct pim_profile* profile = lookup_profile(profile_num);
+    if (profile == NULL) {
+        return -1;
+    }
+    profile->entries++;
+    if (profile->depth++ == 0) {
+        profile->entered = now_ns();
+    }
+    return 0;
+}
+
+int pim_profileexit(int profile_num) {
+    struct pim_profile* profile = lookup_profile(profile_num);
+    if (profile == NULL || profile->depth == 0) {
+        return -1;
+    }
+    if (--profile->depth == 0) {
+        profile->nanoseconds += now_ns() - profile->entered;
+    }
+    return 0;
+}
+
+int pim_profileiterations(int profile_num, long iterations) {
+    struct pim_profile* profile = lookup_profile(profile_num);
+    if (profile == NULL) {
+        return -1;
+    }
+    profile->entries++;
+    profile->iterations += iterations > 0 ? iterations : 0;
+    return 0;
+}
+
+void pim_getstats(struct pim_stats* out) {
+    *out = stats;
+}
+
+void pim_resetstats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+void pim_printstats(void) {
+    printf("[PIM Runtime Report]\n");
+    printf("Dispatches: %llu\n", stats.dispatches);
+    printf("Elements: %llu\n", stats.elements);
+    printf("Simulated PIM cycles: %llu\n", stats.cycles);
+    printf("Row activations: %llu\n", stats.row_activations);
+    printf("Bytes moved: %llu\n", stats.bytes_moved);
+    printf("Host stall cycles: %llu\n", stats.stall_cycles);
+    printf("PIM cycles overlapped with host work: %llu\n", stats.hidden_cycles);
+    printf("Layout conversion cycles: %llu\n", stats.layout_cycles);
+    printf("Estimated PIM energy: %.1f nJ\n", stats.energy_nj);
+    printf("Estimated host cycles: %llu\n", stats.host_cycles);
+    if (stats.host_elements > 0) {
+        printf("Host fallback elements: %llu\n", stats.host_elements);
+    }
+    if (stats.cycles > 0) {
+        printf("Estimated speedup: %.2fx\n", (double)stats.host_cycles / (double)stats.cycles);
+    }
+}
@@ -1,11 +1,126 @@
 //15-745 S20 Project: Optimizing for Processing-In-Memory
 //Angela Li (quinyanl), Siddharth Sahay (ssahay2)
-//autopim/runtime.h: Stub PIM runtime functions that are inserted by the pass
+//autopim/runtime.h: PIM runtime functions that are inserted by the pass
+//The implementation in runtime.c is a functional simulator: the registered
+//sub-loop kernels run on the host, while a DRAM bank/row model accounts for
+//the cycles, row activations and bytes moved the PIM unit would have spent.
 
-int pim_runindex(int pimfn_num, int subloop_num) {
-    return 0;
-}
+#ifndef AUTOPIM_RUNTIME_H
+#define AUTOPIM_RUNTIME_H
 
-int pim_initsubloop(int subloop_num, int range_start, int range_end) {
-    return 0;
-}
+//micro-ops of a sub-loop program, one per node of the extracted computation
+enum pim_op {
+    PIM_OP_NOP = 0,
+    PIM_OP_LOAD,
+    PIM_OP_STORE,
+    PIM_OP_CONSTANT,
+    PIM_OP_ADD,
+    PIM_OP_SUB,
+    PIM_OP_MUL,
+    PIM_OP_DIV,
+    PIM_OP_AND,
+    PIM_OP_OR,
+    PIM_OP_XOR,
+    PIM_OP_SHIFT,
+    PIM_OP_CMP,
+    PIM_OP_MIN,
+    PIM_OP_MAX,
+    PIM_OP_SELECT   //blend two rows through a mask row
+};
+
+//a program entry packs the micro-op with the bit-width it operates on
+#define PIM_INSN(op, bits) ((op) | ((bits) << 8))
+#define PIM_INSN_OP(insn) ((insn) & 0xff)
+#define PIM_INSN_BITS(insn) (((insn) >> 8) & 0xff)
+
+//marks the accumulator load/store and the combining op of a reduction over the outer
+//loop: the accumulator row stays resident while the outer iterations reduce into it
+#define PIM_REDUCE (1 << 16)
+#define PIM_INSN_IS_REDUCE(insn) (((insn) & PIM_REDUCE) != 0)
+
+//layout an array operand is read in, carried by the load/store micro-ops. Row operands stream
+//along DRAM rows in their C layout, strided ones walk a column with one row activation per
+//element. Column-major and vertical (bit-transposed, one row per bit plane) operands were
+//converted by pim_pack, vertical ones only occupy the live bit planes of the element.
+enum pim_layout {
+    PIM_LAYOUT_ROW = 0,
+    PIM_LAYOUT_STRIDED,
+    PIM_LAYOUT_COLUMN,
+    PIM_LAYOUT_VERTICAL
+};
+
+#define PIM_LAYOUT(layout) ((layout) << 17)
+#define PIM_INSN_LAYOUT(insn) (((insn) >> 17) & 0x3)
+
+//marks a store of a conditional loop body: the new row is blended into the old one
+//through the mask, elements whose condition does not hold keep their value
+#define PIM_MASKED (1 << 19)
+#define PIM_INSN_IS_MASKED(insn) (((insn) & PIM_MASKED) != 0)
+
+//signature of the sub_loop_fn<N> kernels, computes a single element of the sub-loop
+typedef void (*pim_kernel_fn)(long outer_index, long inner_index, void** operands);
+
+struct pim_stats {
+    unsigned long long cycles;          //simulated PIM cycles
+    unsigned long long host_cycles;     //estimated cycles for the same work on the host
+    unsigned long long row_activations;
+    unsigned long long bytes_moved;
+    unsigned long long stall_cycles;    //PIM cycles the host spent waiting on
+    unsigned long long hidden_cycles;   //PIM cycles overlapped with host work
+    unsigned long long layout_cycles;   //PIM cycles spent converting array layouts
+    unsigned long long dispatches;
+    unsigned long long elements;
+    unsigned long long host_elements;   //elements of loops the host fallback ran
+    double energy_nj;                   //estimated PIM energy
+};
+
+//pim_registerkernel returns the handle of the kernel, the subloop_num the other calls take, or -1
+int pim_registerkernel(pim_kernel_fn kernel, const int* program, int program_len);
+int pim_initsubloop(int subloop_num, int range_start, int range_end);
+int pim_runindex(int subloop_num, int outer_index, void** operands);
+
+//strip-mine the range of a sub-loop into tiles of tile_elements elements dealt round-robin
+//to banks banks, the last tile of a range may be partial. 0 keeps the runtime's default.
+int pim_tilesubloop(int subloop_num, int tile_elements, int banks);
+
+//batched dispatch: queue the sub-loop for every outer index in [outer_start, outer_end)
+//as a single command, pim_flush ships the queued commands and waits for them
+//pim_runindex is synchronous, it flushes the commands queued before it
+int pim_runrange(int subloop_num, int outer_start, int outer_end, void** operands);
+int pim_flush(void);
+
+//asynchronous dispatch: pim_launch and pim_submit return a ticket without waiting for the
+//PIM unit, pim_wait blocks until the commands behind the ticket have completed
+int pim_launch(int subloop_num, int outer_index, void** operands);
+int pim_submit(void);
+int pim_wait(int ticket);
+
+//layout conversion: pim_pack builds a packed shadow copy of the first elements of an array
+//in the given layout, pim_unpack releases the shadows of an array. The host copy keeps its C layout.
+int pim_pack(const void* base, int elements, int element_bits, int packed_bits, int layout);
+int pim_unpack(const void* base);
+
+//host fallback for loops the pass proved independent but kept off the PIM unit: the range is
+//split into chunks that run in parallel on the host cores, fn runs the loop over one chunk
+typedef void (*pim_host_fn)(long range_start, long range_end, void** operands);
+int pim_hostrange(pim_host_fn fn, int range_start, int range_end, void** operands);
+
+//simulate another target than the default one of pimmodel.h, the pass calls this before
+//registering any kernel when it compiled for a target description
+struct pim_target;
+int pim_settarget(const struct pim_target* target);
+
+//profiling counters of an instrumented build (-autopim-instrument). A loop nest counts its calls
+//and the time spent in it, an innermost loop the times it was entered and its iterations. The
+//counters are written to $AUTOPIM_PROFILE, or autopim.profile, when the program exits.
+//pim_profileloop returns the handle of the counter, the profile_num the other calls take, or -1
+int pim_profileloop(const char* name);
+int pim_profileenter(int profile_num);
+int pim_profileexit(int profile_num);
+int pim_profileiterations(int profile_num, long iterations);
+
+void pim_getstats(struct pim_stats* stats);
+void pim_resetstats(void);
+void pim_printstats(void);
+
+#endif
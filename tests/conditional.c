@@ -0,0 +1,60 @@
+//Conditional loop bodies: the if/else joins into a select, the store under an if becomes a
+//masked store. main checks the result against the same computation done on the host and
+//prints the simulator statistics, link with libpimruntime.a.
+
+#include <stdio.h>
+#include "../runtime.h"
+
+#define ROWS 32
+#define COLS 64
+#define THRESHOLD 8
+
+void conditional(int A[][COLS], int dist[][COLS], int over[][COLS]) {
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            int t;
+            if (A[i][j] > THRESHOLD) {
+                t = A[i][j] - THRESHOLD;
+            }
+            else {
+                t = THRESHOLD - A[i][j];
+            }
+            dist[i][j] = t;
+        }
+        for (int j = 0; j < COLS; j++) {
+            if (A[i][j] > THRESHOLD) {
+                over[i][j] = A[i][j];
+            }
+        }
+    }
+}
+
+int A[ROWS][COLS];
+int dist[ROWS][COLS];
+int over[ROWS][COLS];
+
+int main(void) {
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            A[i][j] = (i * 7 + j * 3) % 17;
+            over[i][j] = -1;
+        }
+    }
+
+    conditional(A, dist, over);
+
+    //the early exit keeps this loop on the host
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            int a = (i * 7 + j * 3) % 17;
+            int expected_dist = a > THRESHOLD ? a - THRESHOLD : THRESHOLD - a;
+            int expected_over = a > THRESHOLD ? a : -1;
+            if (dist[i][j] != expected_dist || over[i][j] != expected_over) {
+                printf("mismatch at [%d][%d]\n", i, j);
+                return 1;
+            }
+        }
+    }
+    pim_printstats();
+    return 0;
+}
@@ -0,0 +1,48 @@
+//Chains of extensions with mixed signedness. (short)(unsigned short)c zero-extends c all
+//the way to int, (unsigned short)(signed char)c copies the sign of c up to 16 bits only,
+//so the kernel has to replay the chain instead of extending c once. main checks the result
+//against the same computation done on the host, link with libpimruntime.a.
+
+#include <stdio.h>
+#include "../runtime.h"
+
+#define ROWS 32
+#define COLS 256
+
+void extension(unsigned char A[][COLS], int zero[][COLS], int sign[][COLS]) {
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            zero[i][j] = (int)(short)(unsigned short)A[i][j] + 1;
+        }
+        for (int j = 0; j < COLS; j++) {
+            sign[i][j] = (int)(unsigned short)(signed char)A[i][j];
+        }
+    }
+}
+
+unsigned char A[ROWS][COLS];
+int zero[ROWS][COLS];
+int sign[ROWS][COLS];
+
+int main(void) {
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            A[i][j] = (unsigned char)(i * 7 + j);
+        }
+    }
+
+    extension(A, zero, sign);
+
+    //the early exit keeps this loop on the host
+    for (int i = 0; i < ROWS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            unsigned char a = (unsigned char)(i * 7 + j);
+            if (zero[i][j] != a + 1 || sign[i][j] != (a < 128 ? a : a + 0xff00)) {
+                printf("mismatch at [%d][%d]\n", i, j);
+                return 1;
+            }
+        }
+    }
+    pim_printstats();
+    return 0;
+}
@@ -0,0 +1,19 @@
+//Multiplies by constants and compare patterns the rewriter simplifies before costing. The
+//printed computation should show 32 * x as x << 5, 7 * x as (x << 3) - x and 10 * x as
+//(x << 3) + (x << 1), a > b and b < a as one shared compare, and !(a < b) as b <= a.
+
+#include "../runtime.h"
+
+#define SEQUENCES 32
+#define BITVECTORS 64
+
+void rewrite(int A[][BITVECTORS], int B[][BITVECTORS], int scaled[][BITVECTORS], int flags[][BITVECTORS]) {
+    for (int i = 0; i < SEQUENCES; i++) {
+        for (int j = 0; j < BITVECTORS; j++) {
+            scaled[i][j] = 32 * A[i][j] + 7 * B[i][j] + 10 * (A[i][j] | 0);
+        }
+        for (int j = 0; j < BITVECTORS; j++) {
+            flags[i][j] = (A[i][j] > B[i][j]) + (B[i][j] < A[i][j]) + !(A[i][j] < B[i][j]);
+        }
+    }
+}
@@ -0,0 +1,12 @@
+//The range of the inner loop is only known at runtime, so the dispatch runs behind a
+//trip count check and the original loop is kept as the host path for short ranges
+
+#include "../runtime.h"
+
+void runtimebound(int out[], int A[][1024], int n) {
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < n; j++) {
+            out[j] = out[j] + (A[i][j] & 15);
+        }
+    }
+}
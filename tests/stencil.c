@@ -0,0 +1,20 @@
+//A loop nest three deep: the innermost loop runs across the lanes of a row, the loop
+//around it is dispatched by the runtime, and the outermost loop stays on the host and
+//passes its index to the kernel. The stencil reads the neighbours of an element, so the
+//inner loops skip the border and do not start at 0.
+
+#include "../runtime.h"
+
+#define PLANES 8
+#define ROWS 64
+#define COLS 64
+
+void stencil(int in[][ROWS][COLS], int out[][ROWS][COLS]) {
+    for (int k = 0; k < PLANES; k++) {
+        for (int i = 1; i < ROWS - 1; i++) {
+            for (int j = 1; j < COLS - 1; j++) {
+                out[k][i][j] = in[k][i - 1][j] + in[k][i + 1][j] + in[k][i][j - 1] + in[k][i][j + 1] - 4 * in[k][i][j];
+            }
+        }
+    }
+}
@@ -0,0 +1,23 @@
+//A sub-loop that stores to two arrays, a sum and a count, is compiled into one
+//multi-output kernel. The second loop reads an element after it stored it, which
+//one kernel writing all its stores at once cannot do, so it stays on the host.
+
+#include "../runtime.h"
+
+#define SEQUENCES 32
+#define BITVECTORS 64
+#define THRESHOLD 100
+
+void sumcount(int A[][BITVECTORS], int sum[], int count[], int mean[], int flag[]) {
+    for (int i = 0; i < SEQUENCES; i++) {
+        for (int j = 0; j < BITVECTORS; j++) {
+            sum[j] = sum[j] + A[i][j];
+            count[j] = count[j] + (A[i][j] > THRESHOLD);
+        }
+    }
+
+    for (int j = 0; j < BITVECTORS; j++) {
+        mean[j] = sum[j] >> 5;
+        flag[j] = mean[j] > THRESHOLD;
+    }
+}